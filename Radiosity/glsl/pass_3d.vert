@@ -5,10 +5,12 @@ layout (location = 1) in vec3 color;
 
 uniform mat4 proj;
 uniform mat4 view;
+uniform vec3 position_offset; // compact results store positions relative to the scene bounds
+uniform vec3 position_scale;
 
 out vec3 fragColor;
 
 void main() {
     fragColor = color;
-    gl_Position = proj * view * vec4(position, 1.0f);
+    gl_Position = proj * view * vec4(position_offset + position_scale * position, 1.0f);
 }
@@ -0,0 +1,59 @@
+#version 330 core
+
+layout (location = 0) out vec4 FragColor;
+
+in vec3 fragColor; // linear radiosity
+
+uniform bool tonemap;        // off until there is a solution to map
+uniform int op;              // TONEMAP_REINHARD or TONEMAP_HISTOGRAM
+uniform int mode;            // TONEMAP_LUMINANCE or TONEMAP_CHANNELS, Reinhard only
+uniform float key;           // middle gray
+uniform float exposure;      // scales the key, set every frame
+uniform float inv_white_sq;  // 1 / white^2, 0 for the plain operator
+uniform vec3 log_average;
+uniform float gamma;
+
+const int HISTOGRAM_BINS = 256;
+const float HISTOGRAM_LOG_MIN = -6.9077553f;
+const float HISTOGRAM_LOG_MAX = 16.118096f;
+
+uniform float curve[HISTOGRAM_BINS + 1]; // display luminance at the bin edges
+
+const vec3 LUMINANCE = vec3(0.2126f, 0.7152f, 0.0722f);
+
+vec3 reinhard(vec3 L) {
+    return L * (1.0f + L * inv_white_sq) / (1.0f + L);
+}
+
+float histogram(float L) {
+    const float bin_width = (HISTOGRAM_LOG_MAX - HISTOGRAM_LOG_MIN) / HISTOGRAM_BINS;
+
+    float x = (log(L) - HISTOGRAM_LOG_MIN) / bin_width;
+    if (x < 0.0f) {
+        return curve[0] * L / exp(HISTOGRAM_LOG_MIN);
+    }
+
+    int e = min(int(x), HISTOGRAM_BINS - 1);
+    return mix(curve[e], curve[e + 1], min(x - e, 1.0f));
+}
+
+void main() {
+    vec3 color = fragColor;
+
+    if (tonemap && op == 1) {
+        float L = dot(LUMINANCE, color);
+        color = (L > 0.0f) ? color * histogram(exposure * L) / L : vec3(0.0f);
+    } else if (tonemap) {
+        vec3 scale = key * exposure / log_average;
+
+        if (mode == 0) {
+            /* Scale by how the luminance maps, keeps the hue */
+            float L = dot(LUMINANCE, color);
+            color = (L > 0.0f) ? color * reinhard(vec3(scale.r * L)).r / L : vec3(0.0f);
+        } else {
+            color = reinhard(scale * color);
+        }
+    }
+
+    FragColor = vec4(pow(clamp(color, 0.0f, 1.0f), vec3(1.0f / gamma)), 1.0f);
+}
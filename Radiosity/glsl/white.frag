@@ -1,9 +0,0 @@
-#version 330 core
-
-layout (location = 0) out vec4 FragColor;
-
-in vec3 fragColor;
-
-void main() {
-    FragColor = vec4(fragColor, 1.0f);
-}
@@ -0,0 +1,28 @@
+#ifndef RADIOSITY_BENCH_H
+#define RADIOSITY_BENCH_H
+
+#include "shared.h"
+#include "bvh.h"
+#include "stats.h"
+
+const long long BENCH_RAYS = 1000000;
+const int BENCH_LAYOUT_REPEATS = 5; // timed runs per BVH layout, the median and the fastest are shown
+const long long BENCH_REFERENCE_RUNS = 16;   // independent TOTAL_RAYS runs averaged into the solver reference
+const long long BENCH_REFERENCE_MARGIN = 10; // a solver under test gets at most this fraction of the reference rays
+/* bench_sampling() ignores TOTAL_RAYS, its rays are fixed so runs on one scene compare */
+const long long BENCH_SAMPLING_RUNS = 32;            // independent random runs averaged into the reference
+const long long BENCH_SAMPLING_REFERENCE = 2000000;  // rays of each reference run
+const long long BENCH_SAMPLING_MIN = 10000;          // the sweep quadruples the rays from here
+const long long BENCH_SAMPLING_MAX = 640000;
+const int BENCH_GATHER_RUNS = 32;          // seeds per vertex the gathered direct light is spread over
+const std::size_t BENCH_GATHER_VERTICES = 1000; // at most this many vertices, evenly strided
+
+void bench_layouts(const scene &sc, scene_bvh &world, const settings &s);
+
+void bench_solvers(scene &sc, const scene_bvh &world, const settings &s);
+
+void bench_sampling(scene &sc, const scene_bvh &world, const settings &s);
+
+void bench_gather(scene &sc, const scene_bvh &world, const settings &s);
+
+#endif //RADIOSITY_BENCH_H
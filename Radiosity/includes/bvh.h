@@ -33,16 +33,68 @@ struct prim_info {
     glm::vec3 centroid;
 };
 
+const std::uint32_t LEAF_BIT = 0x80000000u;
+
+/* Compact node, two per cache line. Interior nodes keep both child offsets
+ * (children are not adjacent in every layout), leaves keep prim_base and
+ * prim_num | LEAF_BIT */
+struct alignas(32) linear_node {
+    aabb box;
+    std::uint32_t offset[2];
+};
+
+enum layout {
+    depth_first,
+    van_emde_boas,
+};
+
+/* Bottom level: BVH over one unique shape, in object space. MAX_CORNERS vertices
+ * per patch are stored in leaf order, primitives maps them back to the shape's own patch order */
+struct mesh_bvh {
+    std::vector<glm::vec3> vertices;
+    std::vector<glm::vec3> normals;
+    std::vector<std::uint32_t> primitives;
+    std::vector<linear_node> nodes;
+};
+
+/* Top level: placements of the unique shapes in the world */
+struct instance {
+    std::size_t mesh;
+    glm::mat4 to_world;
+    glm::mat4 to_object;
+    aabb box;
+    std::uint32_t prim_base; // world-space copies of the patches carry the per-instance radiosity
+    std::uint32_t prim_num;
+};
+
+struct scene_bvh {
+    std::vector<mesh_bvh> meshes;
+    std::vector<instance> instances;
+    std::vector<std::size_t> ordered_instances;
+    std::vector<linear_node> nodes;
+};
+
 const int MAX_DEPTH = 8;
 
-aabb compute_box(const std::vector<patch> &patches);
+aabb compute_box(const glm::vec3 *vertices, std::size_t n);
 
 bool intersect(const ray &r, const aabb &box, float ERR);
 
-bvh_node *bvh(std::vector<patch *> &primitives);
+std::vector<linear_node> bvh(std::vector<glm::vec3> &vertices, std::vector<std::uint32_t> &primitives);
+
+scene_bvh bvh(const scene &sc, const std::vector<instance> &instances);
+
+void rebuild_top(scene_bvh &world);
+
+std::vector<linear_node> flatten(const bvh_node *root);
+
+std::vector<linear_node> reorder(const std::vector<linear_node> &nodes, layout l);
+
+void reorder(scene_bvh &world, layout l);
+
+hit intersect(const ray &r, const mesh_bvh &m, float ERR);
 
-hit intersect(const ray &r, const bvh_node *node,
-              const std::vector<patch *> &primitives, float ERR);
+hit intersect(const ray &r, const scene_bvh &world, float ERR);
 
 std::vector<float> bvh_debug_vertices(const bvh_node *node, int depth);
 
@@ -0,0 +1,39 @@
+#ifndef RADIOSITY_EMITTERS_H
+#define RADIOSITY_EMITTERS_H
+
+#include "shared.h"
+#include "bvh.h"
+
+#include <random>
+
+const std::uint32_t EMITTER_LEAF = 4; // emitters per leaf, picked from with the alias table
+
+/* Vose's alias table entry, over the emitters of one leaf */
+struct alias_entry {
+    float probability; // of keeping this emitter rather than taking the alias
+    std::uint32_t alias; // index into emitter_index::emitters
+};
+
+/* Same layout as linear_node: leaves keep their first emitter and count | LEAF_BIT */
+struct emitter_node {
+    aabb box;
+    float power; // of the emitters below, all wavelengths
+    std::uint32_t offset[2];
+};
+
+/* Built once from the solution for direct light. The tree picks a leaf by power over
+ * distance squared, the alias table an emitter in it by power */
+struct emitter_index {
+    std::vector<std::uint32_t> emitters; // patches in leaf order
+    std::vector<float> share;            // of its leaf's power
+    std::vector<alias_entry> alias;
+    std::vector<emitter_node> nodes;
+    bool uniform; // pick every emitter with the same probability instead, only for comparison
+};
+
+emitter_index build_emitter_index(const scene &sc);
+
+/* An emitter for a receiver at x and the probability it was picked with, O(log emitters) */
+std::uint32_t sample_emitter(const emitter_index &index, const glm::vec3 &x, std::mt19937 &gen, float &pdf);
+
+#endif //RADIOSITY_EMITTERS_H
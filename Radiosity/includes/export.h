@@ -0,0 +1,18 @@
+#ifndef RADIOSITY_EXPORT_H
+#define RADIOSITY_EXPORT_H
+
+#include "result.h"
+
+const std::size_t EXPORT_CHUNK = 1 << 16; // vertices or triangles converted per write
+const int GLB_BOUND_WIDTH = 16;           // characters per POSITION bound in the GLB JSON
+
+/* Both exporters stream a mapped result a chunk at a time with shared vertices. Colors are the
+ * linear solution or tone mapped with the parameters saved in the result */
+
+/* Binary little-endian PLY: float colors when linear, sRGB encoded uchar ones otherwise */
+bool export_ply(const std::string &path, const result_file &result, bool linear);
+
+/* glTF 2.0 binary container (.glb), COLOR_0 is always float */
+bool export_glb(const std::string &path, const result_file &result, bool linear);
+
+#endif //RADIOSITY_EXPORT_H
@@ -0,0 +1,62 @@
+#ifndef RADIOSITY_HIERARCHICAL_H
+#define RADIOSITY_HIERARCHICAL_H
+
+#include "shared.h"
+#include "bvh.h"
+#include "stats.h"
+
+const float HR_BF_EPS = 2e-3f;      // BF refinement threshold, relative to the brightest emitter
+const float HR_MIN_AREA = 1e-4f;    // smallest element, relative to the scene area
+const int HR_LINK_SAMPLES = 8;      // source points and cosine-weighted rays per link, one of each per sample
+const int HR_MAX_GATHERS = 64;      // Jacobi gathers between link refinements
+const float HR_TOLERANCE = 1e-3f;   // relative change of the mean radiosity to stop gathering
+const int HR_REFINE_ROUNDS = 4;
+
+const std::uint32_t NO_PATCH = 0xFFFFFFFFu;
+
+struct link {
+    std::uint32_t source;
+    float F; // form factor with visibility, source -> receiver
+    std::uint32_t first, count; // samples of a cluster source in hierarchy::samples
+};
+
+/* Part of a cluster link that landed on one patch. Cluster radiosity is an average
+ * over faces that need not be the ones the receiver sees, so they gather patch by patch */
+struct link_sample {
+    std::uint32_t patch;
+    float F;
+};
+
+/* Node of the element hierarchy. Clusters group whole patches, the elements
+ * under a patch are its 1:4 subdivisions. Only patch elements receive light,
+ * clusters are linked as sources */
+struct element {
+    glm::vec3 vertices[MAX_CORNERS]; // unused for clusters
+    glm::vec3 center;
+    glm::vec3 normal; // unused for clusters
+    float radius;
+    float area;
+    float split; // unused for clusters, see quad_split()
+    std::uint32_t patch; // NO_PATCH for clusters
+    std::uint32_t first, count; // patch range of a cluster in hierarchy::order
+    std::uint32_t children[4];
+    std::uint32_t children_num;
+    glm::vec3 B;
+    float peak; // brightest luminance in the subtree
+    glm::vec3 gathered;
+    std::vector<link> links;
+};
+
+struct hierarchy {
+    std::vector<element> elements; // patch p is element p
+    std::vector<std::uint32_t> order;
+    std::vector<double> cumulative; // area of the patches in order up to and including each one
+    std::vector<link_sample> samples;
+    std::uint32_t root;
+    float eps;
+    float min_area;
+};
+
+void hierarchical(scene &sc, const settings &s, const scene_bvh &world, stats &stat);
+
+#endif //RADIOSITY_HIERARCHICAL_H
@@ -0,0 +1,34 @@
+#ifndef RADIOSITY_LIGHTMAP_H
+#define RADIOSITY_LIGHTMAP_H
+
+#include "shared.h"
+#include "bvh.h"
+
+const int LIGHTMAP_SIZE = 2048;   // atlas width, the height is what the charts need up to the same
+const int LIGHTMAP_TILE = 64;     // texels per tile side, tiles are baked in parallel
+const int LIGHTMAP_GUTTER = 1;    // texels around each chart so bilinear filtering stays inside
+const int LIGHTMAP_SAMPLES = 128; // gather rays per texel
+const std::string LIGHTMAP_PATH = "models/lightmap.hdr";
+const std::string LIGHTMAP_UV_PATH = "models/lightmap.uv";
+
+/* Every patch is a chart of its own, flattened into its plane and packed on shelves */
+struct lightmap {
+    int width;
+    int height;
+    float texel; // world units per texel
+    std::vector<glm::vec3> texels; // radiosity, row 0 is v = 0
+    std::vector<glm::vec2> uv;     // MAX_CORNERS per patch, like scene::indices
+};
+
+/* Packs the charts and gathers the solution in p_total once per texel with the scene BVH.
+ * Texels hold radiosity, the emission plus reflectance times the mean radiosity seen over
+ * cosine-weighted directions. False when the charts cannot fit the atlas */
+bool bake_lightmap(const scene &sc, const scene_bvh &world, float ERR, lightmap &map);
+
+/* Radiance RGBE image */
+bool save_hdr(const std::string &path, const lightmap &map);
+
+/* Raw floats, 2 * MAX_CORNERS per patch in scene order */
+bool save_uv(const std::string &path, const lightmap &map);
+
+#endif //RADIOSITY_LIGHTMAP_H
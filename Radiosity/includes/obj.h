@@ -0,0 +1,32 @@
+#ifndef RADIOSITY_OBJ_H
+#define RADIOSITY_OBJ_H
+
+#include "shared.h"
+
+const std::size_t OBJ_MIN_CHUNK = 1 << 20; // smaller files are parsed by one thread
+
+struct obj_material {
+    std::string name;
+    glm::vec3 diffuse; // Kd
+    glm::vec3 emit;    // Ka
+};
+
+/* Flat OBJ contents, all indices are zero-based and resolved */
+struct obj_mesh {
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec3> normals;
+    std::vector<std::uint32_t> face_first; // corners of face f are [face_first[f], face_first[f + 1])
+    std::vector<std::int32_t> corner_vertex;
+    std::vector<std::int32_t> corner_normal; // -1 if the corner has no normal
+    std::vector<std::int32_t> face_material; // -1 before the first known usemtl
+    std::vector<std::uint32_t> shape_first;  // shape s is faces [shape_first[s], shape_first[s + 1])
+    std::vector<obj_material> materials;
+};
+
+/* Memory maps the file and parses line-aligned chunks in parallel */
+bool load_obj(const std::string &path, obj_mesh &mesh, std::string &err);
+
+/* Appends the materials of an MTL file, false if it cannot be opened */
+bool load_mtl(const std::string &path, std::vector<obj_material> &materials);
+
+#endif //RADIOSITY_OBJ_H
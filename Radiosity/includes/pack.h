@@ -0,0 +1,71 @@
+#ifndef RADIOSITY_PACK_H
+#define RADIOSITY_PACK_H
+
+#include "shared.h"
+#include "bvh.h"
+#include "stats.h"
+
+/* Binary scene written by rad-pack. A header and a section table are followed by raw
+ * arrays, each starting on a PACK_ALIGN boundary. load_pack() maps the file, copies every
+ * section into the scene with one memcpy and unmaps it again */
+const char PACK_MAGIC[8] = {'R', 'A', 'D', 'P', 'A', 'C', 'K', '\0'};
+const std::uint32_t PACK_VERSION = 3;
+const std::size_t PACK_ALIGN = 64;
+const std::string PACK_EXTENSION = ".radpack";
+
+enum PACK_SECTION {
+    PACK_VERTICES,
+    PACK_INDICES,
+    PACK_VERTEX_PATCH,
+    PACK_NORMALS,
+    PACK_AREA,
+    PACK_SPLIT,
+    PACK_MATERIAL,  // per patch material id
+    PACK_MATERIAL_NAMES, // zero-terminated, in material id order
+    PACK_COLOR,     // material table, one section per wavelength
+    PACK_EMIT,      // material table, one section per wavelength
+    PACK_INSTANCES,
+    /* Prebuilt BVH, the mesh field of the section says which bottom level it belongs to */
+    PACK_MESH_VERTICES,
+    PACK_MESH_NORMALS,
+    PACK_MESH_PRIMITIVES,
+    PACK_MESH_NODES,
+    PACK_WORLD_INSTANCES,
+    PACK_WORLD_ORDER,
+    PACK_WORLD_NODES,
+};
+
+struct alignas(PACK_ALIGN) pack_header {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t sections;
+    std::uint32_t has_bvh;
+    std::uint32_t meshes;
+    /* Struct sizes the file was written with, raw structs are only read back by a matching build */
+    std::uint32_t instance_size;
+    std::uint32_t node_size;
+    std::uint32_t size; // patches
+    std::uint32_t light_sources_count;
+    std::uint32_t instances_count;
+    std::uint32_t meshes_count;
+};
+
+struct pack_section {
+    std::uint32_t type;
+    std::uint32_t mesh; // bottom level of a BVH section, wavelength of a material section
+    std::uint64_t offset; // from the start of the file
+    std::uint64_t bytes;
+    std::uint64_t reserved;
+};
+
+bool is_pack(const std::string &path);
+
+bool save_pack(const std::string &path, const scene &sc, const std::vector<instance> &instances,
+               const scene_bvh *world, const stats &stat);
+
+/* Returns false if the file is missing, was written by another version or its sections do not
+ * fit together, has_bvh tells if 'world' was filled from the file */
+bool load_pack(const std::string &path, scene &sc, std::vector<instance> &instances,
+               scene_bvh &world, bool &has_bvh, stats &stat);
+
+#endif //RADIOSITY_PACK_H
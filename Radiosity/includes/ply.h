@@ -0,0 +1,15 @@
+#ifndef RADIOSITY_PLY_H
+#define RADIOSITY_PLY_H
+
+#include "obj.h"
+
+const std::string PLY_DEFAULT_MATERIAL = "ply_default";
+const float PLY_DEFAULT_DIFFUSE = 0.8f; // faces without a material in the sidecar MTL
+
+/* Binary little-endian PLY scan, read into the same flat arrays as an OBJ file. PLY has no
+ * materials: they come from the sidecar MTL next to the scan (bunny.ply -> bunny.mtl). Faces
+ * use the material selected by their material_index property, or the first one if there is none.
+ * Without the MTL, or with an index it does not have, a face gets a white default material */
+bool load_ply(const std::string &path, obj_mesh &mesh, std::string &err);
+
+#endif //RADIOSITY_PLY_H
@@ -4,27 +4,116 @@
 #include "shared.h"
 #include "bvh.h"
 #include "stats.h"
+#include "emitters.h"
 
 #include <random>
 
-float area(const patch &p);
+extern std::mt19937 mt;
+extern std::uniform_real_distribution<float> unilateral;
 
-glm::vec3 sample_point(const patch *p);
+float area(const glm::vec3 *vertices);
 
-bool visible(const glm::vec3 &a, const glm::vec3 &b, const patch *p_b,
-             const bvh_node *world, const std::vector<patch *> &primitives, float ERR);
+float quad_area(const glm::vec3 *vertices);
+
+float quad_split(const glm::vec3 *vertices);
+
+glm::vec3 sample_point(const glm::vec3 *vertices);
+
+glm::vec3 sample_quad(const glm::vec3 *vertices, float split);
+
+glm::vec3 sample_hemi(const glm::vec3 &normal);
+
+/* Same, with the caller's generator for use from several threads */
+glm::vec3 sample_point(const glm::vec3 *vertices, std::mt19937 &gen);
+
+glm::vec3 sample_quad(const glm::vec3 *vertices, float split, std::mt19937 &gen);
+
+glm::vec3 sample_hemi(const glm::vec3 &normal, std::mt19937 &gen);
+
+/* Same, from the caller's uniform numbers in [0, 1) so they can come from a low-discrepancy sequence */
+glm::vec3 sample_point(const glm::vec3 *vertices, float r1, float r2);
+
+glm::vec3 sample_quad(const glm::vec3 *vertices, float split, float half, float r1, float r2);
+
+glm::vec3 sample_hemi(const glm::vec3 &normal, float u, float v);
+
+bool visible(const glm::vec3 &a, const glm::vec3 &b, const scene &sc, std::uint32_t p_b,
+             const scene_bvh &world, float ERR);
 
 float p2p_form_factor(const glm::vec3 &a, const glm::vec3 &n_a,
-                      const glm::vec3 &b, const patch *p_b, float ERR, int FF_SAMPLES);
+                      const glm::vec3 &b, const glm::vec3 &n_b, float area_b, float ERR, int FF_SAMPLES);
+
+float form_factor(const scene &sc, std::uint32_t here, std::uint32_t there,
+                  const scene_bvh &world, float ERR, int FF_SAMPLES);
+
+const glm::vec3 LUMINANCE(0.2126f, 0.7152f, 0.0722f); // Rec. 709 weights
+const float MIN_LUMINANCE = 1e-3f; // darker colors are left out of the log-average
+
+enum TONEMAP_MODE {
+    TONEMAP_LUMINANCE, // scales a color by how its luminance maps, keeps the hue
+    TONEMAP_CHANNELS,  // maps each wavelength on its own
+};
+
+enum TONEMAP_OPERATOR {
+    TONEMAP_REINHARD,  // global, scaled by the log-average
+    TONEMAP_HISTOGRAM, // histogram adjustment, always by luminance
+};
+
+/* The histogram covers a fixed log-luminance range so it is built in one pass, brighter
+ * colors fall in the last bin */
+const int HISTOGRAM_BINS = 256;
+const float HISTOGRAM_LOG_MIN = -6.9077553f; // ln MIN_LUMINANCE
+const float HISTOGRAM_LOG_MAX = 16.118096f;  // ln 1e7
+const float HISTOGRAM_DISPLAY_RANGE = 100.0f; // brightest over darkest displayed luminance
+const float HISTOGRAM_TOLERANCE = 0.025f;     // of the counts trimmed by the last ceiling pass
+
+/* How reinhard() and histogram_adjust() map linear colors, kept with saved results */
+struct tonemap_params {
+    float key;   // middle gray
+    float white; // smallest scaled value mapped to 1, INF for the plain operator
+    TONEMAP_MODE mode;
+    glm::vec3 log_average; // per wavelength, the luminance one in all three in TONEMAP_LUMINANCE
+    TONEMAP_OPERATOR op;
+    float curve[HISTOGRAM_BINS + 1]; // display luminance at the bin edges
+};
+
+const float REINHARD_KEY = 0.18f;
+const float REINHARD_WHITE = 2.0f; // with -white, scaled values above it burn out to white
+const tonemap_params REINHARD_DEFAULTS = {REINHARD_KEY, INF, TONEMAP_LUMINANCE, glm::vec3(1.0f), TONEMAP_REINHARD, {}};
+
+/* Log-average of packed linear colors for 'mode', one parallel pass */
+glm::vec3 log_average(const std::vector<float> &colors, TONEMAP_MODE mode);
+
+/* Ward's histogram adjustment from a parallel log-luminance histogram of packed linear colors.
+ * The few bright emitters only move the top of the curve instead of scaling every color */
+void histogram_curve(const std::vector<float> &colors, float *curve);
+
+/* Maps 'count' linear colors into display range, 3 floats each. Only reads the solution,
+ * so a finished one can be shown again with another key */
+void reinhard(const float *hdr, float *ldr, std::size_t count, const tonemap_params &tm);
+
+/* Same with the histogram curve in 'tm' */
+void histogram_adjust(const float *hdr, float *ldr, std::size_t count, const tonemap_params &tm);
+
+/* Whichever of the two tm.op picks */
+void tonemap(const float *hdr, float *ldr, std::size_t count, const tonemap_params &tm);
+
+void vertex_radiosity(scene &sc);
+
+void local_line(scene &sc, const settings &s, const scene_bvh &world, stats &stat);
 
-float form_factor(const patch *here, const patch *there,
-                  const bvh_node *world, const std::vector<patch *> &primitives,
-                  float ERR, int FF_SAMPLES);
+void jacobi_iteration(scene &sc, long long rays, const scene_bvh &world, float ERR, bool qmc);
 
-void reinhard(std::vector<float> &vertices);
+const std::size_t INTERPOLATE_BLOCK = 256; // vertices per block, blocks are gathered in parallel
+const int GATHER_G_RAYS = 64; // hemisphere rays per vertex with -gather
+const int GATHER_S_RAYS = 16; // shadow rays per vertex with -gather
 
-void local_line(std::vector<patch *> &primitives, const settings &s, const bvh_node *world, stats &stat);
+/* Direct light from 'lights' plus one bounce of the solution, seen from vertex v as a corner of patch p */
+glm::vec3 gather(const scene &sc, const scene_bvh &world, const emitter_index &lights, std::uint32_t v,
+                 std::uint32_t p, int G_RAYS, int S_RAYS, float ERR, bool qmc, std::mt19937 &gen);
 
-void interpolate(std::vector<patch *> &primitives, bvh_node *world, int G_RAYS, int S_RAYS, float ERR);
+/* Final gather of the solution at the vertices, rays are per vertex and carry all three wavelengths.
+ * With qmc the shadow ray points and hemisphere directions come from Sobol points scrambled per corner */
+void interpolate(scene &sc, const scene_bvh &world, int G_RAYS, int S_RAYS, float ERR, bool qmc, bool verbose);
 
 #endif //RADIOSITY_RADIOSITY_H
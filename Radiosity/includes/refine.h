@@ -0,0 +1,12 @@
+#ifndef RADIOSITY_REFINE_H
+#define RADIOSITY_REFINE_H
+
+#include "shared.h"
+#include "bvh.h"
+
+const float REFINE_THRESHOLD = 0.2f; // relative radiosity difference between neighbours
+const int REFINE_LEVELS = 3;
+
+std::uint32_t refine(scene &sc, std::vector<instance> &instances, float threshold);
+
+#endif //RADIOSITY_REFINE_H
@@ -0,0 +1,98 @@
+#ifndef RADIOSITY_RESULT_H
+#define RADIOSITY_RESULT_H
+
+#include "shared.h"
+#include "radiosity.h"
+
+/* Solved mesh written by -s and shown by -l. A header and a section table are followed by
+ * the vertex and index arrays, each on its own page so the mapped file goes to OpenGL as it is */
+const char RESULT_MAGIC[8] = {'R', 'A', 'D', 'R', 'E', 'S', '\0', '\0'};
+const std::uint32_t RESULT_VERSION = 5;
+const std::size_t RESULT_ALIGN = 4096;
+const std::string RESULT_PATH = "models/saved_data.bin";
+
+enum RESULT_SECTION {
+    RESULT_POSITIONS, // per vertex, attribute 0
+    RESULT_COLORS,    // per vertex linear radiosity, tone mapped for attribute 1
+    RESULT_INDICES,   // 3 per triangle
+};
+
+/* Component type of a section. -compact saves 12 instead of 24 bytes per vertex:
+ * positions as RESULT_UNORM16 over the scene bounds, off by extent / 131070 per axis plus float rounding,
+ * and colors as RESULT_FLOAT16, off by at most 2^-11 relative (2^-25 absolute below 2^-14) */
+enum RESULT_FORMAT {
+    RESULT_FLOAT32,
+    RESULT_UINT32,
+    RESULT_FLOAT16,
+    RESULT_UNORM16,
+};
+
+enum RESULT_SOLVER {
+    RESULT_LOCAL_LINE,
+    RESULT_ADAPTIVE,
+    RESULT_HIERARCHICAL,
+};
+
+struct alignas(64) result_header {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t sections;
+    std::uint64_t vertex_count;
+    std::uint64_t triangle_count;
+    std::uint64_t mesh_hash; // of the source mesh file
+    std::uint64_t checksum;  // of every section payload, in table order
+    /* Solver settings */
+    std::uint64_t rays;
+    float err;
+    std::uint32_t solver;
+    /* Tone mapping the solution was shown with */
+    float key;
+    float white;
+    std::uint32_t tonemap_mode;
+    float log_average[3];
+    std::uint32_t tonemap_operator;
+    float curve[HISTOGRAM_BINS + 1];
+    /* Drawn position = offset + scale * stored position */
+    float position_offset[3];
+    float position_scale[3];
+};
+
+struct result_section {
+    std::uint32_t type;
+    std::uint32_t format;
+    std::uint32_t components; // per vertex or per triangle corner
+    std::uint32_t reserved;
+    std::uint64_t offset; // from the start of the file
+    std::uint64_t bytes;
+};
+
+/* A mapped result file, the sections point into the mapping */
+struct result_file {
+    const result_header *header;
+    const result_section *sections[3]; // by RESULT_SECTION
+    const char *data;
+    std::size_t size;
+};
+
+/* 64-bit FNV-1a, a word at a time */
+std::uint64_t checksum(const void *data, std::size_t bytes, std::uint64_t hash);
+
+bool save_result(const std::string &path, const scene &sc, const std::vector<float> &colors,
+                 const std::vector<std::uint32_t> &indices, const settings &s, const tonemap_params &tm);
+
+/* Half float colors and 16-bit positions over the scene bounds */
+bool save_compact_result(const std::string &path, const scene &sc, const std::vector<float> &colors,
+                         const std::vector<std::uint32_t> &indices, const settings &s, const tonemap_params &tm);
+
+/* Returns false if the file is missing, was written by another version or fails its checksum */
+bool map_result(const std::string &path, result_file &result);
+
+void unmap_result(result_file &result);
+
+tonemap_params result_tonemap(const result_file &result);
+
+/* Creates the buffers straight from the mapped sections, the colors stay linear for the
+ * tone mapping shader. Returns the index count */
+std::size_t upload_result(const result_file &result, GLuint *VAO, GLuint *VBO, GLuint *CBO, GLuint *EBO);
+
+#endif //RADIOSITY_RESULT_H
@@ -25,6 +25,8 @@ namespace utils {
         template<typename T>
         void set_uniform(const std::string &var_string, const T &&data) const;
 
+        void set_uniform_array(const std::string &var_string, const float *data, int count) const;
+
         void use_program() const;
 
         shader(const shader &other) = delete;
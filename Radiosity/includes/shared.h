@@ -8,6 +8,7 @@
 
 #include <glm/glm.hpp>
 #include <vector>
+#include <cstdint>
 #include <string>
 
 #include <thread>
@@ -16,24 +17,70 @@
 
 const float INF = std::numeric_limits<float>::infinity();
 
-struct patch {
-    glm::vec3 vertices[4];
-    glm::vec3 colors[4];
-    glm::vec3 normal;
-    glm::vec3 color;
-    glm::vec3 rad;
-    glm::vec3 rad_new;
-    glm::vec3 emit;
-    glm::vec3 p_total;
-    glm::vec3 p_unshot;
-    glm::vec3 p_recieved;
-    float area;
+const int MAX_CORNERS = 4; // patches are quads, a triangle repeats its last corner
+const std::size_t MAX_MATERIALS = 0xFFFF; // material ids are 16 bit
+
+/* Patch data split by access pattern, all arrays are addressed by a 32-bit patch index.
+ * Per-wavelength arrays keep the shooting loop to one float per patch */
+struct scene {
+    std::uint32_t size;
+
+    /* Geometry, vertices are shared between the patches of one smooth surface */
+    std::vector<glm::vec3> vertices;
+    std::vector<std::uint32_t> indices; // MAX_CORNERS per patch
+    std::vector<std::uint32_t> vertex_patch; // a patch the vertex belongs to, for its normal and material
+    std::vector<glm::vec3> normal;
+    std::vector<float> area;
+    std::vector<float> split; // share of the area in the 0-1-2 half, see quad_split()
+
+    /* Material table, patches keep an index into it. Editing a material is a table update */
+    std::vector<std::uint16_t> material; // per patch
+    std::vector<std::string> material_name;
+    std::vector<float> color[3]; // per material
+    std::vector<float> emit[3];  // per material
+    std::vector<std::uint32_t> emitters; // patches with a non-zero emission, see find_emitters()
+
+    /* Solver power state */
+    std::vector<float> p_total[3];
+    std::vector<float> p_unshot[3];
+    std::vector<float> p_recieved[3];
+    std::uint32_t pass; // shooting passes since the solve began, each one is scrambled differently
+
+    /* Output, per vertex */
+    std::vector<glm::vec3> colors;
+};
+
+struct quad {
+    glm::vec3 vertices[MAX_CORNERS];
 };
 
+inline quad corners(const scene &sc, std::uint32_t p) {
+    return {{sc.vertices[sc.indices[MAX_CORNERS * p + 0]],
+             sc.vertices[sc.indices[MAX_CORNERS * p + 1]],
+             sc.vertices[sc.indices[MAX_CORNERS * p + 2]],
+             sc.vertices[sc.indices[MAX_CORNERS * p + 3]]}};
+}
+
+inline bool is_quad(const scene &sc, std::uint32_t p) {
+    return sc.indices[MAX_CORNERS * p + 3] != sc.indices[MAX_CORNERS * p + 2];
+}
+
+inline int corners_count(const scene &sc, std::uint32_t p) {
+    return is_quad(sc, p) ? 4 : 3;
+}
+
+inline float reflectance(const scene &sc, int wave_len, std::uint32_t p) {
+    return sc.color[wave_len][sc.material[p]];
+}
+
+inline float emittance(const scene &sc, int wave_len, std::uint32_t p) {
+    return sc.emit[wave_len][sc.material[p]];
+}
+
 struct hit {
     bool hit;
     float t;
-    patch *p;
+    std::uint32_t id;
 };
 
 struct ray {
@@ -56,8 +103,21 @@ struct settings {
     bool verbose;
     bool invalid;
     bool debug;
+    bool bench;
+    bool adaptive;
+    bool hierarchical;
+    bool compact;
+    bool bake;
+    bool histogram;
+    bool qmc;
+    bool bench_sampling;
+    bool channels;
+    bool white;
+    bool gather;
 };
 
-float intersect(const ray &r, const patch &p, float ERR);
+float intersect(const ray &r, const glm::vec3 *vertices, float ERR);
+
+float intersect_quad(const ray &r, const glm::vec3 *vertices, float ERR);
 
 #endif //RADIOSITY_SHARED_H
@@ -0,0 +1,16 @@
+#ifndef RADIOSITY_SOBOL_H
+#define RADIOSITY_SOBOL_H
+
+#include <cstdint>
+
+/* Quad half, two barycentrics and two hemisphere angles: everything a local line needs */
+const int SOBOL_DIMENSIONS = 5;
+
+/* Mixes two values into a scrambling seed, so patches and passes get uncorrelated points */
+std::uint32_t sobol_seed(std::uint32_t a, std::uint32_t b);
+
+/* Dimension 'dimension' of point i of the Sobol sequence in [0, 1), Owen scrambled by 'seed'
+ * (hash-based nested uniform scrambling, Burley 2020). Any prefix of the points stays stratified */
+float sobol(std::uint32_t i, int dimension, std::uint32_t seed);
+
+#endif //RADIOSITY_SOBOL_H
@@ -20,9 +20,31 @@ struct stats {
     long long light_sources_count;
     long long rays_number;
     long long polygons_count;
+    long long welded_count;     // vertices merged into a coincident one at load
+    long long degenerate_count; // faces and patches dropped for a collapsed edge or no area
+    long long flipped_count;    // faces whose winding disagreed with the file normals
+    long long fanned_count;     // faces ear clipping could not split, fanned instead
+    long long instances_count;
+    long long meshes_count;
     long long iterations_number;
 };
 
+/* Hardware cache counters for the calling thread, -1 where perf is not available */
+enum COUNTER {
+    L1_MISSES,
+    LLC_MISSES,
+    TLB_MISSES,
+    COUNTERS_NUM
+};
+
+struct perf_counters {
+    int fd[COUNTERS_NUM];
+};
+
+perf_counters start_counters();
+
+void stop_counters(perf_counters &counters, long long *values);
+
 void output_stats(stats &stat);
 
 #endif //RADIOSITY_TIMER_H
@@ -5,18 +5,53 @@
 #include "bvh.h"
 #include "stats.h"
 
-const std::set<std::string> ALLOWED_FLAGS{"-stats", "-l", "-s", "-v", "-d"};
+#include <functional>
+
+const std::size_t PARALLEL_MIN_CHUNK = 1 << 16; // elements per thread for cheap per-vertex passes
+
+const std::set<std::string> ALLOWED_FLAGS{"-stats", "-l", "-s", "-v", "-d", "-bench", "-a", "-hr", "-compact", "-bake", "-histogram", "-qmc", "-bench-sampling", "-channels", "-white", "-gather"};
 
 void load_settings(const std::string &path, settings &s);
 
+/* Threads parallel_ranges() uses for 'count' elements */
+std::size_t parallel_threads(std::size_t count, std::size_t min_chunk);
+
+/* Runs fn(from, to, thread) on one contiguous range of [0, count) per thread, the calling
+ * thread takes the first one */
+void parallel_ranges(std::size_t count, std::size_t min_chunk,
+                     const std::function<void(std::size_t, std::size_t, std::size_t)> &fn);
+
+/* Runs fn(item, thread) for every item of [0, count), handed out one at a time through a shared
+ * counter for work too uneven to split up front. The calling thread is thread 0 */
+void parallel_items(std::size_t count, const std::function<void(std::size_t, std::size_t)> &fn);
+
 settings process_flags(int argc, char **argv);
 
-std::vector<patch> load_mesh(const std::string &path, stats &stat);
+scene load_mesh(const std::string &path, std::vector<instance> &instances, stats &stat);
+
+/* Rebuilds the emitter list from the material table */
+void find_emitters(scene &sc);
+
+/* Changes a material for every patch that uses it, e.g. a light's intensity */
+void set_material(scene &sc, std::uint16_t id, const glm::vec3 &color, const glm::vec3 &emit);
+
+/* Materials that emit in any wavelength, in id order */
+std::vector<std::uint16_t> light_materials(const scene &sc);
+
+/* Packs the per-vertex colors, 3 floats each, into 'colors' which must hold 3 * sc.vertices.size()
+ * floats, e.g. a preallocated vector or a mapped buffer. Vertex ranges are split across threads */
+void glify(const scene &sc, float *colors);
+
+std::vector<std::uint32_t> triangles(const scene &sc);
 
-std::vector<float> glify(const std::vector<patch *> &primitives, bool fill);
+/* Positions (VBO) and colors (CBO) live in separate buffers, so a new solution only rewrites the colors */
+void init_buffers(GLuint *VAO, GLuint *VBO, GLuint *CBO, GLuint *EBO, const std::vector<glm::vec3> &positions,
+                  const std::vector<float> &colors, const std::vector<std::uint32_t> &indices);
 
-void init_buffers(GLuint *VAO, GLuint *VBO, std::vector<float> &vertices);
+/* Respecifies every buffer, for when the mesh itself has changed */
+void update_buffers(GLuint *VAO, GLuint *VBO, GLuint *CBO, GLuint *EBO, const std::vector<glm::vec3> &positions,
+                    const std::vector<float> &colors, const std::vector<std::uint32_t> &indices);
 
-void update_buffers(GLuint *VAO, GLuint *VBO, std::vector<float> &vertices);
+void update_colors(GLuint *CBO, const std::vector<float> &colors);
 
 #endif //RADIOSITY_UTILS_H
@@ -0,0 +1,338 @@
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+
+#include "../includes/bench.h"
+#include "../includes/radiosity.h"
+#include "../includes/hierarchical.h"
+
+void output_counter(const std::string &name, long long before, long long after) {
+    std::cout << "| " << std::right << std::setw(15) << name << std::left;
+
+    if (before < 0 || after < 0) {
+        std::cout << "n/a" << std::endl;
+        return;
+    }
+
+    std::cout << std::setw(12) << before << " -> " << std::setw(12) << after;
+    if (before > 0) {
+        std::cout << std::setprecision(3) << 100.0 * (before - after) / before << "% less";
+    }
+    std::cout << std::endl;
+}
+
+template<typename T>
+T median(std::vector<T> values) {
+    std::nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+    return values[values.size() / 2];
+}
+
+/* Shoot the same batch of local lines through the depth-first and the van Emde Boas node layouts
+ * and compare the time and cache misses. Each layout is timed BENCH_LAYOUT_REPEATS times after an
+ * untimed warm-up pass, the two take turns going first */
+void bench_layouts(const scene &sc, scene_bvh &world, const settings &s) {
+    long long rays_num = std::min(s.TOTAL_RAYS, BENCH_RAYS);
+    std::vector<ray> rays(rays_num);
+
+    for (long long i = 0; i < rays_num; i++) {
+        auto p = (std::uint32_t) (i % sc.size);
+        rays[i] = {sample_quad(corners(sc, p).vertices, sc.split[p]), sample_hemi(sc.normal[p])};
+    }
+
+    const layout layouts[] = {layout::depth_first, layout::van_emde_boas};
+    std::vector<long long> misses[2][COUNTER::COUNTERS_NUM];
+    std::vector<double> time[2];
+    long long hits = 0;
+
+    for (int repeat = 0; repeat < BENCH_LAYOUT_REPEATS; repeat++) {
+        for (int turn = 0; turn < 2; turn++) {
+            int l = (turn + repeat) % 2;
+            reorder(world, layouts[l]);
+
+            /* Warm-up, the freshly reordered nodes are paged in and cached like in a solve */
+            hits = 0;
+            for (const auto &r : rays) {
+                hits += intersect(r, world, s.ERR).hit;
+            }
+
+            double start = glfwGetTime();
+            perf_counters counters = start_counters();
+
+            for (const auto &r : rays) {
+                hits += intersect(r, world, s.ERR).hit;
+            }
+
+            long long counted[COUNTER::COUNTERS_NUM];
+            stop_counters(counters, counted);
+            time[l].push_back(glfwGetTime() - start);
+
+            for (int c = 0; c < COUNTER::COUNTERS_NUM; c++) {
+                misses[l][c].push_back(counted[c]);
+            }
+        }
+    }
+
+    std::cout << "[=========BENCH=========]" << std::endl;
+    std::cout << "| " << std::right << std::setw(15) << "RAYS: "
+              << std::left << rays_num << " (" << hits / 2 << " hits), "
+              << BENCH_LAYOUT_REPEATS << " runs per layout" << std::endl;
+    std::cout << "| " << std::right << std::setw(15) << "MEDIAN TIME: "
+              << std::left << std::setprecision(5)
+              << median(time[0]) * 1000.0 << "ms -> " << median(time[1]) * 1000.0 << "ms" << std::endl;
+    std::cout << "| " << std::right << std::setw(15) << "MIN TIME: "
+              << std::left << std::setprecision(5)
+              << *std::min_element(time[0].begin(), time[0].end()) * 1000.0 << "ms -> "
+              << *std::min_element(time[1].begin(), time[1].end()) * 1000.0 << "ms" << std::endl;
+    output_counter("L1 MISSES: ", median(misses[0][COUNTER::L1_MISSES]), median(misses[1][COUNTER::L1_MISSES]));
+    output_counter("LLC MISSES: ", median(misses[0][COUNTER::LLC_MISSES]), median(misses[1][COUNTER::LLC_MISSES]));
+    output_counter("TLB MISSES: ", median(misses[0][COUNTER::TLB_MISSES]), median(misses[1][COUNTER::TLB_MISSES]));
+    std::cout << "[=======================]" << std::endl;
+}
+
+/* Area-weighted RMS error of the patch radiosity, relative to the reflected part */
+double radiosity_error(const scene &sc, const std::vector<float> *reference) {
+    double error = 0.0;
+    double norm = 0.0;
+
+    for (int wave_len = 0; wave_len < 3; wave_len++) {
+        for (std::uint32_t p = 0; p < sc.size; p++) {
+            if (sc.area[p] <= 0.0f) {
+                continue;
+            }
+
+            double d = sc.p_total[wave_len][p] - reference[wave_len][p];
+            double reflected = reference[wave_len][p] - emittance(sc, wave_len, p) * sc.area[p];
+            error += d * d / sc.area[p];
+            norm += reflected * reflected / sc.area[p];
+        }
+    }
+
+    return norm > 0.0 ? glm::sqrt(error / norm) : 0.0;
+}
+
+/* Mean of 'runs' independent local line solutions, summed in doubles. One long run would not do:
+ * the float powers stop taking in the tiny per-ray increments and the reference ends up biased.
+ * Returns the error of the mean itself, estimated from the spread of the runs */
+double build_reference(scene &sc, const scene_bvh &world, const settings &quiet, long long runs,
+                       std::vector<float> *reference) {
+    stats stat = {};
+    std::vector<double> sum[3];
+    std::vector<double> squares[3];
+    for (int wave_len = 0; wave_len < 3; wave_len++) {
+        sum[wave_len].assign(sc.size, 0.0);
+        squares[wave_len].assign(sc.size, 0.0);
+    }
+
+    for (long long run = 0; run < runs; run++) {
+        local_line(sc, quiet, world, stat);
+
+        for (int wave_len = 0; wave_len < 3; wave_len++) {
+            for (std::uint32_t p = 0; p < sc.size; p++) {
+                sum[wave_len][p] += sc.p_total[wave_len][p];
+                squares[wave_len][p] += (double) sc.p_total[wave_len][p] * sc.p_total[wave_len][p];
+            }
+        }
+    }
+
+    /* Same weighting as radiosity_error(), with the variance of the mean in place of the squared error */
+    double error = 0.0;
+    double norm = 0.0;
+
+    for (int wave_len = 0; wave_len < 3; wave_len++) {
+        reference[wave_len].resize(sc.size);
+
+        for (std::uint32_t p = 0; p < sc.size; p++) {
+            double mean = sum[wave_len][p] / (double) runs;
+            reference[wave_len][p] = (float) mean;
+
+            if (sc.area[p] <= 0.0f || runs < 2) {
+                continue;
+            }
+
+            double variance = (squares[wave_len][p] - runs * mean * mean) / (double) (runs - 1);
+            double reflected = mean - emittance(sc, wave_len, p) * sc.area[p];
+            error += glm::max(variance, 0.0) / (double) runs / sc.area[p];
+            norm += reflected * reflected / sc.area[p];
+        }
+    }
+
+    return norm > 0.0 ? glm::sqrt(error / norm) : 0.0;
+}
+
+/* Time the hierarchical solver and the local line solver at the same error, measured against
+ * the mean of BENCH_REFERENCE_RUNS local line runs. Local line never gets more than
+ * 1 / BENCH_REFERENCE_MARGIN of the reference rays, so it is not measured against itself */
+void bench_solvers(scene &sc, const scene_bvh &world, const settings &s) {
+    stats stat = {};
+    settings quiet = s;
+    quiet.verbose = false;
+
+    std::vector<float> reference[3];
+    double reference_noise = build_reference(sc, world, quiet, BENCH_REFERENCE_RUNS, reference);
+    long long reference_rays = s.TOTAL_RAYS * BENCH_REFERENCE_RUNS;
+
+    hierarchical(sc, quiet, world, stat);
+    double hr_time = stat.events[EVENT::SIJIA_END] - stat.events[EVENT::SIJIA_BEGIN];
+    double hr_error = radiosity_error(sc, reference);
+
+    /* Double the rays until the local line solver is as accurate */
+    double ll_time = 0.0;
+    double ll_error = 0.0;
+    bool matched = false;
+
+    for (quiet.TOTAL_RAYS = glm::max(s.TOTAL_RAYS / 1024, 1LL);
+         quiet.TOTAL_RAYS * BENCH_REFERENCE_MARGIN <= reference_rays; quiet.TOTAL_RAYS *= 2) {
+        local_line(sc, quiet, world, stat);
+        ll_time = stat.events[EVENT::SIJIA_END] - stat.events[EVENT::SIJIA_BEGIN];
+        ll_error = radiosity_error(sc, reference);
+
+        if (ll_error <= hr_error) {
+            matched = true;
+            break;
+        }
+    }
+
+    if (!matched) {
+        quiet.TOTAL_RAYS /= 2;
+    }
+
+    std::cout << "[=========BENCH=========]" << std::endl;
+    std::cout << "| " << std::right << std::setw(15) << "REFERENCE: "
+              << std::left << BENCH_REFERENCE_RUNS << " x " << s.TOTAL_RAYS << " rays, error "
+              << std::setprecision(3) << 100.0 * reference_noise << "%" << std::endl;
+    std::cout << "| " << std::right << std::setw(15) << "HIERARCHICAL: "
+              << std::left << std::setprecision(5) << hr_time * 1000.0 << "ms, error "
+              << std::setprecision(3) << 100.0 * hr_error << "%"
+              << (hr_error < 2.0 * reference_noise ? " (near the reference error)" : "") << std::endl;
+    std::cout << "| " << std::right << std::setw(15) << "LOCAL LINE: "
+              << std::left << std::setprecision(5) << ll_time * 1000.0 << "ms, error "
+              << std::setprecision(3) << 100.0 * ll_error << "% (" << quiet.TOTAL_RAYS << " rays"
+              << (matched ? "" : ", not matched") << ")" << std::endl;
+    if (matched && hr_time > 0.0) {
+        std::cout << "| " << std::right << std::setw(15) << "SPEEDUP: "
+                  << std::left << std::setprecision(3) << ll_time / hr_time << "x" << std::endl;
+    }
+    std::cout << "[=======================]" << std::endl;
+}
+
+/* Error of the local line solver with random and with Sobol sampling as the rays quadruple,
+ * against the mean of independent random runs */
+void bench_sampling(scene &sc, const scene_bvh &world, const settings &s) {
+    stats stat = {};
+    settings quiet = s;
+    quiet.verbose = false;
+    quiet.qmc = false;
+    quiet.TOTAL_RAYS = BENCH_SAMPLING_REFERENCE;
+
+    std::vector<float> reference[3];
+    double reference_noise = build_reference(sc, world, quiet, BENCH_SAMPLING_RUNS, reference);
+
+    std::cout << "[=========BENCH=========]" << std::endl;
+    std::cout << "| " << std::right << std::setw(15) << "REFERENCE: "
+              << std::left << BENCH_SAMPLING_RUNS << " x " << BENCH_SAMPLING_REFERENCE << " rays, error "
+              << std::setprecision(3) << 100.0 * reference_noise << "%" << std::endl;
+    std::cout << "| " << std::right << std::setw(15) << "RAYS: "
+              << std::left << std::setw(12) << "RANDOM" << "SOBOL" << std::endl;
+
+    for (quiet.TOTAL_RAYS = BENCH_SAMPLING_MIN; quiet.TOTAL_RAYS <= BENCH_SAMPLING_MAX; quiet.TOTAL_RAYS *= 4) {
+        double error[2];
+
+        for (int qmc = 0; qmc < 2; qmc++) {
+            quiet.qmc = qmc == 1;
+            local_line(sc, quiet, world, stat);
+            error[qmc] = radiosity_error(sc, reference);
+        }
+
+        std::cout << "| " << std::right << std::setw(13) << quiet.TOTAL_RAYS << ": "
+                  << std::left << std::setprecision(3) << std::setw(12) << 100.0 * error[0]
+                  << 100.0 * error[1] << std::endl;
+    }
+
+    std::cout << "[=======================]" << std::endl;
+}
+
+/* Spread of the direct light gathered at the receiving vertices over independent seeds, with the emitters
+ * picked by power over distance squared and picked uniformly. Both get the same seeds and shadow rays */
+void bench_gather(scene &sc, const scene_bvh &world, const settings &s) {
+    stats stat = {};
+    settings quiet = s;
+    quiet.verbose = false;
+    local_line(sc, quiet, world, stat);
+
+    emitter_index lights[2] = {build_emitter_index(sc), build_emitter_index(sc)};
+    lights[1].uniform = true;
+
+    if (lights[0].emitters.empty()) {
+        return;
+    }
+
+    std::size_t stride = std::max(sc.vertices.size() / BENCH_GATHER_VERTICES, (std::size_t) 1);
+    std::size_t vertices = 0;
+    double variance[2] = {0.0, 0.0};
+    double norm = 0.0;
+
+    for (std::size_t v = 0; v < sc.vertices.size(); v += stride) {
+        /* Emitters keep their own radiosity, they would swamp the receivers */
+        std::uint32_t p = sc.vertex_patch[v];
+        if (emittance(sc, 0, p) + emittance(sc, 1, p) + emittance(sc, 2, p) > s.ERR) {
+            continue;
+        }
+
+        vertices++;
+        for (int pick = 0; pick < 2; pick++) {
+            double sum[3] = {0.0, 0.0, 0.0};
+            double squares[3] = {0.0, 0.0, 0.0};
+
+            for (int run = 0; run < BENCH_GATHER_RUNS; run++) {
+                std::mt19937 gen((std::uint32_t) (v * BENCH_GATHER_RUNS + run));
+                glm::vec3 direct = gather(sc, world, lights[pick], (std::uint32_t) v, p, 0, GATHER_S_RAYS,
+                                          s.ERR, false, gen);
+
+                for (int wave_len = 0; wave_len < 3; wave_len++) {
+                    sum[wave_len] += direct[wave_len];
+                    squares[wave_len] += direct[wave_len] * direct[wave_len];
+                }
+            }
+
+            for (int wave_len = 0; wave_len < 3; wave_len++) {
+                double mean = sum[wave_len] / BENCH_GATHER_RUNS;
+                variance[pick] += squares[wave_len] / BENCH_GATHER_RUNS - mean * mean;
+                norm += pick == 0 ? mean * mean : 0.0;
+            }
+        }
+    }
+
+    /* The full gather once for all three wavelengths, against one pass per wavelength the way
+     * interpolate() used to run. Each of those traces the same rays again for one channel */
+    double pass_time[2];
+    for (int passes = 0; passes < 2; passes++) {
+        double start = glfwGetTime();
+
+        for (int wave_len = 0; wave_len < (passes == 0 ? 1 : 3); wave_len++) {
+            for (std::size_t v = 0; v < sc.vertices.size(); v += stride) {
+                std::mt19937 gen((std::uint32_t) v);
+                gather(sc, world, lights[0], (std::uint32_t) v, sc.vertex_patch[v], GATHER_G_RAYS, GATHER_S_RAYS,
+                       s.ERR, false, gen);
+            }
+        }
+
+        pass_time[passes] = glfwGetTime() - start;
+    }
+
+    std::cout << "[=========BENCH=========]" << std::endl;
+    std::cout << "| " << std::right << std::setw(15) << "GATHER: "
+              << std::left << vertices << " vertices x " << BENCH_GATHER_RUNS << " seeds, "
+              << GATHER_S_RAYS << " shadow rays, " << lights[0].emitters.size() << " emitters" << std::endl;
+    std::cout << "| " << std::right << std::setw(15) << "POWER: "
+              << std::left << std::setprecision(3) << 100.0 * glm::sqrt(variance[0] / norm) << "% deviation" << std::endl;
+    std::cout << "| " << std::right << std::setw(15) << "UNIFORM: "
+              << std::left << std::setprecision(3) << 100.0 * glm::sqrt(variance[1] / norm) << "% deviation" << std::endl;
+    if (variance[0] > 0.0) {
+        std::cout << "| " << std::right << std::setw(15) << "VARIANCE: "
+                  << std::left << std::setprecision(3) << variance[1] / variance[0] << "x less" << std::endl;
+    }
+    std::cout << "| " << std::right << std::setw(15) << "RGB PASSES: "
+              << std::left << std::setprecision(5) << pass_time[1] * 1000.0 << "ms -> "
+              << pass_time[0] * 1000.0 << "ms (" << GATHER_G_RAYS << " + " << GATHER_S_RAYS << " rays)" << std::endl;
+    std::cout << "[=======================]" << std::endl;
+}
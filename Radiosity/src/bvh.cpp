@@ -1,43 +1,18 @@
 #include "../includes/bvh.h"
+#include "../includes/radiosity.h"
 
 #include <algorithm>
 
-std::vector<patch *> patches(const std::vector<patch *> &primitives, bvh_node *node) {
-    std::vector<patch *> res;
-
-    if (node->prim_num > 0) {
-        for (int i = 0; i < node->prim_num; i++) {
-            res.push_back(primitives[node->prim_base + i]);
-        }
-    }
-
-    if (node->split != axis::none) {
-        if (node->children[0] != nullptr) {
-            auto c0_res = patches(primitives, node->children[0]);
-            res.insert(res.end(), c0_res.begin(), c0_res.end());
-        }
-
-        if (node->children[1] != nullptr) {
-            auto c1_res = patches(primitives, node->children[1]);
-            res.insert(res.end(), c1_res.begin(), c1_res.end());
-        }
-    }
-
-    return res;
-}
-
-aabb compute_box(const std::vector<patch> &patches) {
+aabb compute_box(const glm::vec3 *vertices, std::size_t n) {
     aabb box = {};
 
     box.near = glm::vec3(INF, INF, INF);
     box.far = -1.0f * box.near;
 
-    for (const auto &p : patches) {
+    for (std::size_t j = 0; j < n; j++) {
         for (int i = 0; i < b_planes; i++) {
-            for (int j = 0; j < 3; j++) {
-                box.near[i] = std::min(p.vertices[j][i], box.near[i]);
-                box.far[i] = std::max(p.vertices[j][i], box.far[i]);
-            }
+            box.near[i] = std::min(vertices[j][i], box.near[i]);
+            box.far[i] = std::max(vertices[j][i], box.far[i]);
         }
     }
 
@@ -121,11 +96,20 @@ axis max_extent(const aabb &box) {
     }
 }
 
+void init_leaf(bvh_node *leaf, std::vector<prim_info> &primitive_info, std::size_t start,
+               std::size_t end, std::vector<std::size_t> &ordered_indices, const aabb &box) {
+    auto first_offset = ordered_indices.size();
+    for (auto i = start; i < end; i++) {
+        ordered_indices.push_back(primitive_info[i].prim_idx);
+    }
+    init_leaf(leaf, first_offset, end - start, box);
+}
+
 bvh_node *rec_build(std::vector<prim_info> &primitive_info, std::size_t start,
-                    std::size_t end, std::vector<patch *> &ordered_primititves,
-                    std::vector<patch *> &primitives) {
+                    std::size_t end, std::vector<std::size_t> &ordered_indices) {
 
     bvh_node *node = (bvh_node *) malloc(sizeof(bvh_node));
+    node->parent = nullptr;
 
     aabb bounds = primitive_info[start].box;
     for (auto i = start; i < end; i++) {
@@ -134,12 +118,7 @@ bvh_node *rec_build(std::vector<prim_info> &primitive_info, std::size_t start,
 
     std::size_t prim_count = end - start;
     if (prim_count == 1) {
-        auto first_offset = ordered_primititves.size();
-        for (auto i = start; i < end; i++) {
-            auto prim_num = primitive_info[i].prim_idx;
-            ordered_primititves.push_back(primitives[prim_num]);
-        }
-        init_leaf(node, first_offset, prim_count, bounds);
+        init_leaf(node, primitive_info, start, end, ordered_indices, bounds);
 
         return node;
     } else {
@@ -155,13 +134,7 @@ bvh_node *rec_build(std::vector<prim_info> &primitive_info, std::size_t start,
         auto mid = (start + end) / 2;
 
         if (centroid_box.far[dim] == centroid_box.near[dim]) {
-            // TODO: вынести функцию
-            auto first_offset = ordered_primititves.size();
-            for (auto i = start; i < end; i++) {
-                auto prim_num = primitive_info[i].prim_idx;
-                ordered_primititves.push_back(primitives[prim_num]);
-            }
-            init_leaf(node, first_offset, prim_count, bounds);
+            init_leaf(node, primitive_info, start, end, ordered_indices, bounds);
 
             return node;
         } else {
@@ -174,78 +147,331 @@ bvh_node *rec_build(std::vector<prim_info> &primitive_info, std::size_t start,
             // end for now
 
             init_interior(node, dim,
-                          rec_build(primitive_info, start, mid, ordered_primititves, primitives),
-                          rec_build(primitive_info, mid, end, ordered_primititves, primitives));
+                          rec_build(primitive_info, start, mid, ordered_indices),
+                          rec_build(primitive_info, mid, end, ordered_indices));
         }
     }
 
     return node;
 }
 
-bvh_node *bvh(std::vector<patch *> &primitives) {
+void free_tree(bvh_node *node) {
+    if (node->split != axis::none) {
+        free_tree(node->children[0]);
+        free_tree(node->children[1]);
+    }
+
+    free(node);
+}
+
+/* Patches are MAX_CORNERS consecutive vertices, both arrays are permuted to leaf order */
+std::vector<linear_node> bvh(std::vector<glm::vec3> &vertices, std::vector<std::uint32_t> &primitives) {
     /* 1. Bounding volumes for each primitive */
     std::vector<prim_info> primitive_info(primitives.size());
-    std::vector<patch *> ordered_primititves;
+    std::vector<std::size_t> ordered_indices;
+    std::vector<std::uint32_t> ordered_primititves;
+    std::vector<glm::vec3> ordered_vertices;
 
     for (std::size_t i = 0; i < primitives.size(); i++) {
-        auto box = compute_box({*primitives[i]});
+        auto box = compute_box(&vertices[MAX_CORNERS * i], MAX_CORNERS);
         primitive_info[i] = {i, box, (box.near + box.far) / 2.0f};
     }
 
     /* 2. Construct the BVH */
-    bvh_node *root = rec_build(primitive_info, 0, primitives.size(), ordered_primititves, primitives);
+    bvh_node *root = rec_build(primitive_info, 0, primitives.size(), ordered_indices);
+
+    for (auto idx : ordered_indices) {
+        ordered_primititves.push_back(primitives[idx]);
+        for (int v = 0; v < MAX_CORNERS; v++) {
+            ordered_vertices.push_back(vertices[MAX_CORNERS * idx + v]);
+        }
+    }
     std::swap(ordered_primititves, primitives);
+    std::swap(ordered_vertices, vertices);
 
     /* 3. Convert to compact */
-    // TODO
+    auto nodes = flatten(root);
+    free_tree(root);
+
+    return reorder(nodes, layout::van_emde_boas);
+}
+
+std::uint32_t flatten(const bvh_node *node, std::vector<linear_node> &nodes) {
+    auto idx = (std::uint32_t) nodes.size();
+    nodes.emplace_back();
+    nodes[idx].box = node->box;
+
+    if (node->split == axis::none) {
+        nodes[idx].offset[0] = (std::uint32_t) node->prim_base;
+        nodes[idx].offset[1] = (std::uint32_t) node->prim_num | LEAF_BIT;
+    } else {
+        auto c0 = flatten(node->children[0], nodes);
+        auto c1 = flatten(node->children[1], nodes);
+        nodes[idx].offset[0] = c0;
+        nodes[idx].offset[1] = c1;
+    }
+
+    return idx;
+}
+
+std::vector<linear_node> flatten(const bvh_node *root) {
+    std::vector<linear_node> nodes;
+    flatten(root, nodes);
+    return nodes;
+}
+
+inline bool is_leaf(const linear_node &node) {
+    return (node.offset[1] & LEAF_BIT) != 0;
+}
+
+int height(const std::vector<linear_node> &nodes, std::uint32_t idx) {
+    if (is_leaf(nodes[idx])) {
+        return 1;
+    }
+
+    return 1 + std::max(height(nodes, nodes[idx].offset[0]), height(nodes, nodes[idx].offset[1]));
+}
+
+void depth_first_order(const std::vector<linear_node> &nodes, std::uint32_t idx,
+                       std::vector<std::uint32_t> &order) {
+    order.push_back(idx);
+
+    if (!is_leaf(nodes[idx])) {
+        depth_first_order(nodes, nodes[idx].offset[0], order);
+        depth_first_order(nodes, nodes[idx].offset[1], order);
+    }
+}
+
+/* Nodes exactly 'depth' levels below idx */
+void frontier(const std::vector<linear_node> &nodes, std::uint32_t idx, int depth,
+              std::vector<std::uint32_t> &res) {
+    if (depth == 0) {
+        res.push_back(idx);
+    } else if (!is_leaf(nodes[idx])) {
+        frontier(nodes, nodes[idx].offset[0], depth - 1, res);
+        frontier(nodes, nodes[idx].offset[1], depth - 1, res);
+    }
+}
+
+/* Cache-oblivious layout: the top half of the levels goes first, then each of the
+ * bottom subtrees, all laid out the same way. The hot top levels end up packed
+ * in the first cache lines and every subtree occupies a contiguous range */
+void van_emde_boas_order(const std::vector<linear_node> &nodes, std::uint32_t idx, int levels,
+                         std::vector<std::uint32_t> &order) {
+    if (levels <= 1 || is_leaf(nodes[idx])) {
+        order.push_back(idx);
+        return;
+    }
+
+    int top = levels / 2;
+    std::vector<std::uint32_t> roots;
+
+    van_emde_boas_order(nodes, idx, top, order);
+    frontier(nodes, idx, top, roots);
+
+    for (auto root : roots) {
+        van_emde_boas_order(nodes, root, levels - top, order);
+    }
+}
+
+std::vector<linear_node> reorder(const std::vector<linear_node> &nodes, layout l) {
+    if (nodes.empty()) {
+        return nodes;
+    }
+
+    std::vector<std::uint32_t> order;
+    order.reserve(nodes.size());
+
+    if (l == layout::van_emde_boas) {
+        van_emde_boas_order(nodes, 0, height(nodes, 0), order);
+    } else {
+        depth_first_order(nodes, 0, order);
+    }
 
-    return root;
+    std::vector<std::uint32_t> new_idx(nodes.size());
+    for (std::uint32_t i = 0; i < order.size(); i++) {
+        new_idx[order[i]] = i;
+    }
+
+    std::vector<linear_node> res(nodes.size());
+    for (std::uint32_t i = 0; i < order.size(); i++) {
+        res[i] = nodes[order[i]];
+
+        if (!is_leaf(res[i])) {
+            res[i].offset[0] = new_idx[res[i].offset[0]];
+            res[i].offset[1] = new_idx[res[i].offset[1]];
+        }
+    }
+
+    return res;
 }
 
-hit intersect(const ray &r, const bvh_node *node,
-              const std::vector<patch *> &primitives, float ERR) {
+void reorder(scene_bvh &world, layout l) {
+    for (auto &m : world.meshes) {
+        m.nodes = reorder(m.nodes, l);
+    }
+
+    world.nodes = reorder(world.nodes, l);
+}
+
+glm::vec3 transform_point(const glm::vec3 &v, const glm::mat4 &m) {
+    return glm::vec3(m * glm::vec4(v, 1.0f));
+}
+
+/* Normals go through the inverse transpose */
+glm::vec3 transform_normal(const glm::vec3 &n, const glm::mat4 &m) {
+    return glm::normalize(glm::vec3(glm::transpose(glm::inverse(m)) * glm::vec4(n, 0.0f)));
+}
+
+aabb transform(const aabb &box, const glm::mat4 &m) {
+    aabb res = {};
+    res.near = glm::vec3(INF);
+    res.far = glm::vec3(INF * -1.0f);
+
+    for (int i = 0; i < 8; i++) {
+        glm::vec3 corner((i & 1) ? box.far.x : box.near.x,
+                         (i & 2) ? box.far.y : box.near.y,
+                         (i & 4) ? box.far.z : box.near.z);
+        res = join(res, transform_point(corner, m));
+    }
+
+    return res;
+}
+
+void rebuild_top(scene_bvh &world) {
+    std::vector<prim_info> instance_info(world.instances.size());
+
+    for (std::size_t i = 0; i < world.instances.size(); i++) {
+        auto &box = world.instances[i].box;
+        instance_info[i] = {i, box, (box.near + box.far) / 2.0f};
+    }
+
+    world.ordered_instances.clear();
+    world.nodes.clear();
+
+    /* Nothing left to hit, e.g. every face of the file was degenerate */
+    if (instance_info.empty()) {
+        return;
+    }
+
+    bvh_node *root = rec_build(instance_info, 0, instance_info.size(), world.ordered_instances);
+
+    world.nodes = reorder(flatten(root), layout::van_emde_boas);
+    free_tree(root);
+}
+
+/* Two-level BVH: one bottom level per unique shape, one top level over the instances */
+scene_bvh bvh(const scene &sc, const std::vector<instance> &instances) {
+    scene_bvh world = {};
+    world.instances = instances;
+
+    /* 1. Bottom levels, built in object space from the first instance of each shape */
+    for (auto &inst : world.instances) {
+        if (inst.mesh == world.meshes.size()) {
+            world.meshes.emplace_back();
+            mesh_bvh &m = world.meshes.back();
+
+            for (std::uint32_t i = 0; i < inst.prim_num; i++) {
+                quad q = corners(sc, inst.prim_base + i);
+                for (auto &v : q.vertices) {
+                    m.vertices.push_back(transform_point(v, inst.to_object));
+                }
+                m.normals.push_back(transform_normal(sc.normal[inst.prim_base + i], inst.to_object));
+                m.primitives.push_back(i);
+            }
+
+            m.nodes = bvh(m.vertices, m.primitives);
+        }
 
-    if (!intersect(r, node->box, ERR)) {
-        hit res = {};
-        res.hit = false;
-        return res;
+        inst.box = transform(world.meshes[inst.mesh].nodes[0].box, inst.to_world);
     }
 
+    /* 2. Top level */
+    rebuild_top(world);
+
+    return world;
+}
+
+hit intersect(const ray &r, const mesh_bvh &m, float ERR) {
     hit ret = {};
     ret.hit = false;
     ret.t = INF;
 
-    if (node->split == axis::none) {
-        for (int i = 0; i < node->prim_num; i++) {
-            float t_now = intersect(r, *primitives[node->prim_base + i], ERR);
-            if (t_now > ERR) {
-                if (t_now < ret.t) {
+    std::uint32_t stack[64];
+    int top = 0;
+    stack[top++] = 0;
+
+    while (top > 0) {
+        const linear_node &node = m.nodes[stack[--top]];
+
+        if (!intersect(r, node.box, ERR)) {
+            continue;
+        }
+
+        if (is_leaf(node)) {
+            std::uint32_t prim_num = node.offset[1] & ~LEAF_BIT;
+
+            for (std::uint32_t i = node.offset[0]; i < node.offset[0] + prim_num; i++) {
+                float t_now = intersect_quad(r, &m.vertices[MAX_CORNERS * i], ERR);
+                if (t_now > ERR && t_now < ret.t) {
                     ret.t = t_now;
                     ret.hit = true;
-                    ret.p = primitives[node->prim_base + i];
+                    ret.id = m.primitives[i];
                 }
             }
+        } else {
+            stack[top++] = node.offset[1];
+            stack[top++] = node.offset[0];
         }
-    } else {
-        auto hit_c0 = intersect(r, node->children[0], primitives, ERR);
-        auto hit_c1 = intersect(r, node->children[1], primitives, ERR);
-
-        if (hit_c0.hit && hit_c0.t > ERR) {
-            if (hit_c0.t < ret.t) {
-                ret.t = hit_c0.t;
-                ret.p = hit_c0.p;
-                ret.hit = true;
-            }
+    }
+
+    return ret;
+}
+
+hit intersect(const ray &r, const scene_bvh &world, float ERR) {
+    hit ret = {};
+    ret.hit = false;
+    ret.t = INF;
+
+    if (world.nodes.empty()) {
+        return ret;
+    }
+
+    std::uint32_t stack[64];
+    int top = 0;
+    stack[top++] = 0;
+
+    while (top > 0) {
+        const linear_node &node = world.nodes[stack[--top]];
+
+        if (!intersect(r, node.box, ERR)) {
+            continue;
         }
 
-        if (hit_c1.hit && hit_c1.t > ERR) {
-            if (hit_c1.t < ret.t) {
-                ret.t = hit_c1.t;
-                ret.p = hit_c1.p;
-                ret.hit = true;
+        if (is_leaf(node)) {
+            std::uint32_t inst_num = node.offset[1] & ~LEAF_BIT;
+
+            for (std::uint32_t i = 0; i < inst_num; i++) {
+                const instance &inst = world.instances[world.ordered_instances[node.offset[0] + i]];
+                const mesh_bvh &m = world.meshes[inst.mesh];
+
+                /* The direction is not renormalized, so t stays comparable between instances */
+                ray local = {};
+                local.origin = glm::vec3(inst.to_object * glm::vec4(r.origin, 1.0f));
+                local.direction = glm::vec3(inst.to_object * glm::vec4(r.direction, 0.0f));
+
+                hit h = intersect(local, m, ERR);
+                if (h.hit && h.t < ret.t) {
+                    ret.t = h.t;
+                    ret.hit = true;
+                    ret.id = inst.prim_base + h.id;
+                }
             }
+        } else {
+            stack[top++] = node.offset[1];
+            stack[top++] = node.offset[0];
         }
     }
 
     return ret;
-}
\ No newline at end of file
+}
@@ -0,0 +1,172 @@
+#include "../includes/emitters.h"
+#include "../includes/radiosity.h"
+
+#include <algorithm>
+
+float emitter_power(const scene &sc, std::uint32_t p) {
+    return sc.p_total[0][p] + sc.p_total[1][p] + sc.p_total[2][p];
+}
+
+/* Vose's method over entries [from, to) */
+void build_alias(emitter_index &index, const std::vector<float> &power, std::uint32_t from, std::uint32_t to,
+                 float total) {
+    std::uint32_t n = to - from;
+    std::vector<float> scaled(n);
+    std::vector<std::uint32_t> small, large;
+
+    for (std::uint32_t i = 0; i < n; i++) {
+        index.share[from + i] = power[from + i] / total;
+        scaled[i] = index.share[from + i] * n;
+        (scaled[i] < 1.0f ? small : large).push_back(i);
+    }
+
+    while (!small.empty() && !large.empty()) {
+        std::uint32_t s = small.back(), l = large.back();
+        small.pop_back();
+
+        index.alias[from + s] = {scaled[s], from + l};
+        scaled[l] -= 1.0f - scaled[s];
+
+        if (scaled[l] < 1.0f) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+
+    /* What is left is 1 up to rounding */
+    for (auto i : small) { index.alias[from + i] = {1.0f, from + i}; }
+    for (auto i : large) { index.alias[from + i] = {1.0f, from + i}; }
+}
+
+/* Reorders [from, to) of the emitters, their powers and centroids into leaf order */
+std::uint32_t build_node(emitter_index &index, const scene &sc, std::vector<float> &power,
+                         std::vector<glm::vec3> &centroids, std::uint32_t from, std::uint32_t to) {
+    std::uint32_t id = (std::uint32_t) index.nodes.size();
+    index.nodes.emplace_back();
+
+    emitter_node node = {};
+    node.box = {glm::vec3(INF), glm::vec3(-INF)};
+    aabb centroid_box = {glm::vec3(INF), glm::vec3(-INF)};
+
+    for (std::uint32_t i = from; i < to; i++) {
+        quad q = corners(sc, index.emitters[i]);
+        aabb box = compute_box(q.vertices, MAX_CORNERS);
+
+        node.box.near = glm::min(node.box.near, box.near);
+        node.box.far = glm::max(node.box.far, box.far);
+        centroid_box.near = glm::min(centroid_box.near, centroids[i]);
+        centroid_box.far = glm::max(centroid_box.far, centroids[i]);
+        node.power += power[i];
+    }
+
+    if (to - from <= EMITTER_LEAF) {
+        node.offset[0] = from;
+        node.offset[1] = (to - from) | LEAF_BIT;
+        build_alias(index, power, from, to, node.power);
+    } else {
+        /* Median split along the widest extent of the centroids */
+        glm::vec3 extent = centroid_box.far - centroid_box.near;
+        int axis = (extent.x > extent.y && extent.x > extent.z) ? 0 : (extent.y > extent.z ? 1 : 2);
+        std::uint32_t mid = from + (to - from) / 2;
+
+        std::vector<std::uint32_t> order(to - from);
+        for (std::uint32_t i = 0; i < order.size(); i++) { order[i] = from + i; }
+        std::nth_element(order.begin(), order.begin() + (mid - from), order.end(),
+                         [&](std::uint32_t a, std::uint32_t b) { return centroids[a][axis] < centroids[b][axis]; });
+
+        std::vector<std::uint32_t> emitters(order.size());
+        std::vector<float> powers(order.size());
+        std::vector<glm::vec3> moved(order.size());
+        for (std::uint32_t i = 0; i < order.size(); i++) {
+            emitters[i] = index.emitters[order[i]];
+            powers[i] = power[order[i]];
+            moved[i] = centroids[order[i]];
+        }
+
+        std::copy(emitters.begin(), emitters.end(), index.emitters.begin() + from);
+        std::copy(powers.begin(), powers.end(), power.begin() + from);
+        std::copy(moved.begin(), moved.end(), centroids.begin() + from);
+
+        node.offset[0] = build_node(index, sc, power, centroids, from, mid);
+        node.offset[1] = build_node(index, sc, power, centroids, mid, to);
+    }
+
+    index.nodes[id] = node;
+
+    return id;
+}
+
+emitter_index build_emitter_index(const scene &sc) {
+    emitter_index index = {};
+    std::vector<float> power;
+    std::vector<glm::vec3> centroids;
+
+    /* Emitters that give off nothing are never worth a shadow ray */
+    for (auto p : sc.emitters) {
+        if (emitter_power(sc, p) > 0.0f) {
+            quad q = corners(sc, p);
+            index.emitters.push_back(p);
+            power.push_back(emitter_power(sc, p));
+            centroids.push_back(0.25f * (q.vertices[0] + q.vertices[1] + q.vertices[2] + q.vertices[3]));
+        }
+    }
+
+    if (index.emitters.empty()) {
+        return index;
+    }
+
+    index.share.resize(index.emitters.size());
+    index.alias.resize(index.emitters.size());
+    build_node(index, sc, power, centroids, 0, (std::uint32_t) index.emitters.size());
+
+    return index;
+}
+
+/* Power over the distance to the box center, no closer than half its diagonal */
+inline float importance(const emitter_node &node, const glm::vec3 &x) {
+    glm::vec3 center = 0.5f * (node.box.near + node.box.far);
+    glm::vec3 half = 0.5f * (node.box.far - node.box.near);
+
+    return node.power / glm::max(glm::dot(x - center, x - center), glm::dot(half, half));
+}
+
+std::uint32_t sample_emitter(const emitter_index &index, const glm::vec3 &x, std::mt19937 &gen, float &pdf) {
+    if (index.uniform) {
+        auto count = (std::uint32_t) index.emitters.size();
+        pdf = 1.0f / (float) count;
+        return index.emitters[std::min((std::uint32_t) (unilateral(gen) * count), count - 1)];
+    }
+
+    const emitter_node *node = &index.nodes[0];
+    pdf = 1.0f;
+
+    while (!(node->offset[1] & LEAF_BIT)) {
+        const emitter_node &left = index.nodes[node->offset[0]];
+        const emitter_node &right = index.nodes[node->offset[1]];
+
+        float w_left = importance(left, x);
+        float w_right = importance(right, x);
+        float p_left = w_left / (w_left + w_right);
+
+        if (unilateral(gen) < p_left) {
+            pdf *= p_left;
+            node = &left;
+        } else {
+            pdf *= 1.0f - p_left;
+            node = &right;
+        }
+    }
+
+    std::uint32_t count = node->offset[1] & ~LEAF_BIT;
+    float u = unilateral(gen) * count;
+    std::uint32_t i = node->offset[0] + std::min((std::uint32_t) u, count - 1);
+
+    const alias_entry &entry = index.alias[i];
+    if (u - (float) (i - node->offset[0]) >= entry.probability) {
+        i = entry.alias;
+    }
+
+    pdf *= index.share[i];
+
+    return index.emitters[i];
+}
@@ -0,0 +1,250 @@
+#include "../includes/export.h"
+
+#include <glm/gtc/packing.hpp>
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+/* Positions and colors of vertices [from, from + count), decoded from whatever the result stores */
+void decode_chunk(const result_file &result, std::size_t from, std::size_t count, bool linear,
+                  std::vector<glm::vec3> &positions, std::vector<float> &colors) {
+    const result_section *ps = result.sections[RESULT_POSITIONS];
+    const result_section *cs = result.sections[RESULT_COLORS];
+
+    positions.resize(count);
+    colors.resize(3 * count);
+
+    if (ps->format == RESULT_UNORM16) {
+        auto q = (const std::uint16_t *) (result.data + ps->offset) + 3 * from;
+        const float *offset = result.header->position_offset;
+        const float *scale = result.header->position_scale;
+
+        for (std::size_t v = 0; v < count; v++) {
+            for (int i = 0; i < 3; i++) {
+                positions[v][i] = offset[i] + scale[i] * (q[v * 3 + i] / 65535.0f);
+            }
+        }
+    } else {
+        std::memcpy(positions.data(), result.data + ps->offset + from * sizeof(glm::vec3), count * sizeof(glm::vec3));
+    }
+
+    if (cs->format == RESULT_FLOAT16) {
+        auto halves = (const std::uint16_t *) (result.data + cs->offset) + 3 * from;
+        for (std::size_t i = 0; i < 3 * count; i++) {
+            colors[i] = glm::unpackHalf1x16(halves[i]);
+        }
+    } else {
+        std::memcpy(colors.data(), result.data + cs->offset + 3 * from * sizeof(float), 3 * count * sizeof(float));
+    }
+
+    if (!linear) {
+        tonemap(colors.data(), colors.data(), count, result_tonemap(result));
+    }
+}
+
+const std::uint32_t *result_indices(const result_file &result) {
+    return (const std::uint32_t *) (result.data + result.sections[RESULT_INDICES]->offset);
+}
+
+std::uint8_t srgb_byte(float c) {
+    c = glm::clamp(c, 0.0f, 1.0f);
+    c = (c <= 0.0031308f) ? 12.92f * c : 1.055f * std::pow(c, 1.0f / 2.4f) - 0.055f;
+    return (std::uint8_t) std::lround(c * 255.0f);
+}
+
+template<typename T>
+void put(std::vector<char> &buffer, const T &value) {
+    buffer.insert(buffer.end(), (const char *) &value, (const char *) &value + sizeof(T));
+}
+
+bool export_ply(const std::string &path, const result_file &result, bool linear) {
+    std::ofstream file(path.c_str(), std::ios::out | std::ios::binary);
+    if (!file) {
+        std::cerr << "Cannot write " << path << std::endl;
+        return false;
+    }
+
+    std::size_t vertex_count = result.header->vertex_count;
+    std::size_t triangle_count = result.header->triangle_count;
+    const char *color_type = linear ? "float" : "uchar";
+
+    file << "ply\n"
+         << "format binary_little_endian 1.0\n"
+         << "comment radiosity solution, " << (linear ? "linear" : "tone mapped") << " colors\n"
+         << "element vertex " << vertex_count << "\n"
+         << "property float x\n"
+         << "property float y\n"
+         << "property float z\n"
+         << "property " << color_type << " red\n"
+         << "property " << color_type << " green\n"
+         << "property " << color_type << " blue\n"
+         << "element face " << triangle_count << "\n"
+         << "property list uchar uint vertex_indices\n"
+         << "end_header\n";
+
+    std::vector<glm::vec3> positions;
+    std::vector<float> colors;
+    std::vector<char> buffer;
+
+    for (std::size_t from = 0; from < vertex_count; from += EXPORT_CHUNK) {
+        std::size_t count = std::min(EXPORT_CHUNK, vertex_count - from);
+        decode_chunk(result, from, count, linear, positions, colors);
+
+        buffer.clear();
+        for (std::size_t v = 0; v < count; v++) {
+            put(buffer, positions[v]);
+            for (int i = 0; i < 3; i++) {
+                if (linear) {
+                    put(buffer, colors[v * 3 + i]);
+                } else {
+                    put(buffer, srgb_byte(colors[v * 3 + i]));
+                }
+            }
+        }
+
+        file.write(buffer.data(), buffer.size());
+    }
+
+    const std::uint32_t *indices = result_indices(result);
+    const std::uint8_t CORNERS = 3;
+
+    for (std::size_t from = 0; from < triangle_count; from += EXPORT_CHUNK) {
+        std::size_t count = std::min(EXPORT_CHUNK, triangle_count - from);
+
+        buffer.clear();
+        for (std::size_t t = from; t < from + count; t++) {
+            put(buffer, CORNERS);
+            buffer.insert(buffer.end(), (const char *) &indices[3 * t], (const char *) &indices[3 * t + 3]);
+        }
+
+        file.write(buffer.data(), buffer.size());
+    }
+
+    return (bool) file;
+}
+
+/* Fixed width wide enough for any float, so the JSON keeps its length when the bounds are filled in */
+void put_bound(std::ostream &json, float value) {
+    json << std::setw(GLB_BOUND_WIDTH) << std::scientific << std::setprecision(8) << value;
+}
+
+std::string glb_json(std::size_t vertex_count, std::size_t triangle_count, std::uint64_t vec3_bytes,
+                     std::uint64_t index_bytes, const glm::vec3 &min, const glm::vec3 &max) {
+    std::ostringstream json;
+    json << R"({"asset":{"version":"2.0","generator":"rad-export"},"scene":0,"scenes":[{"nodes":[0]}],)"
+         << R"("nodes":[{"mesh":0}],"meshes":[{"primitives":[{"attributes":{"POSITION":0,"COLOR_0":1},)"
+         << R"("indices":2,"mode":4}]}],)"
+         << R"("buffers":[{"byteLength":)" << 2 * vec3_bytes + index_bytes << "}],"
+         << R"("bufferViews":[)"
+         << R"({"buffer":0,"byteOffset":0,"byteLength":)" << vec3_bytes << R"(,"target":34962},)"
+         << R"({"buffer":0,"byteOffset":)" << vec3_bytes << R"(,"byteLength":)" << vec3_bytes
+         << R"(,"target":34962},)"
+         << R"({"buffer":0,"byteOffset":)" << 2 * vec3_bytes << R"(,"byteLength":)" << index_bytes
+         << R"(,"target":34963}],)"
+         << R"("accessors":[)"
+         << R"({"bufferView":0,"componentType":5126,"count":)" << vertex_count << R"(,"type":"VEC3",)"
+         << R"("min":[)";
+    put_bound(json, min.x);
+    json << ",";
+    put_bound(json, min.y);
+    json << ",";
+    put_bound(json, min.z);
+    json << R"(],"max":[)";
+    put_bound(json, max.x);
+    json << ",";
+    put_bound(json, max.y);
+    json << ",";
+    put_bound(json, max.z);
+    json << std::defaultfloat
+         << "]},"
+         << R"({"bufferView":1,"componentType":5126,"count":)" << vertex_count << R"(,"type":"VEC3"},)"
+         << R"({"bufferView":2,"componentType":5125,"count":)" << 3 * triangle_count << R"(,"type":"SCALAR"}]})";
+
+    std::string header = json.str();
+    header.resize((header.size() + 3) / 4 * 4, ' ');
+
+    return header;
+}
+
+bool export_glb(const std::string &path, const result_file &result, bool linear) {
+    const std::uint32_t GLB_MAGIC = 0x46546C67; // "glTF"
+    const std::uint32_t GLB_JSON = 0x4E4F534A;
+    const std::uint32_t GLB_BIN = 0x004E4942;
+
+    std::size_t vertex_count = result.header->vertex_count;
+    std::size_t triangle_count = result.header->triangle_count;
+
+    /* Positions, colors and indices follow each other in the one buffer */
+    std::uint64_t vec3_bytes = vertex_count * sizeof(glm::vec3);
+    std::uint64_t index_bytes = 3 * triangle_count * sizeof(std::uint32_t);
+    std::uint64_t bin_bytes = 2 * vec3_bytes + index_bytes;
+
+    /* POSITION needs its bounds, they are filled in once the positions have gone by */
+    glm::vec3 min(0.0f), max(0.0f);
+    std::string header = glb_json(vertex_count, triangle_count, vec3_bytes, index_bytes, min, max);
+    std::uint64_t total_bytes = 12 + 8 + header.size() + 8 + bin_bytes;
+
+    /* Every length in a GLB is 32 bit */
+    if (total_bytes > UINT32_MAX) {
+        std::cerr << "Cannot export " << path << ": " << total_bytes << " bytes, a GLB holds at most "
+                  << UINT32_MAX << std::endl;
+        return false;
+    }
+
+    std::ofstream file(path.c_str(), std::ios::out | std::ios::binary);
+    if (!file) {
+        std::cerr << "Cannot write " << path << std::endl;
+        return false;
+    }
+
+    std::vector<char> buffer;
+    put(buffer, GLB_MAGIC);
+    put(buffer, (std::uint32_t) 2);
+    put(buffer, (std::uint32_t) total_bytes);
+    put(buffer, (std::uint32_t) header.size());
+    put(buffer, GLB_JSON);
+    std::uint64_t json_offset = buffer.size();
+    buffer.insert(buffer.end(), header.begin(), header.end());
+    put(buffer, (std::uint32_t) bin_bytes);
+    put(buffer, GLB_BIN);
+    file.write(buffer.data(), buffer.size());
+
+    /* One decode per chunk, its positions and colors go to their own parts of the buffer */
+    std::uint64_t bin_offset = buffer.size();
+    std::vector<glm::vec3> positions;
+    std::vector<float> colors;
+    min = glm::vec3(INF);
+    max = glm::vec3(-INF);
+
+    for (std::size_t from = 0; from < vertex_count; from += EXPORT_CHUNK) {
+        std::size_t count = std::min(EXPORT_CHUNK, vertex_count - from);
+        decode_chunk(result, from, count, linear, positions, colors);
+
+        for (const auto &p : positions) {
+            min = glm::min(min, p);
+            max = glm::max(max, p);
+        }
+
+        file.seekp((std::streamoff) (bin_offset + from * sizeof(glm::vec3)));
+        file.write((const char *) positions.data(), count * sizeof(glm::vec3));
+        file.seekp((std::streamoff) (bin_offset + vec3_bytes + from * sizeof(glm::vec3)));
+        file.write((const char *) colors.data(), 3 * count * sizeof(float));
+    }
+
+    /* Indices are written from the mapping as they are */
+    file.seekp((std::streamoff) (bin_offset + 2 * vec3_bytes));
+    file.write((const char *) result_indices(result), index_bytes);
+
+    if (vertex_count > 0) {
+        std::string bounded = glb_json(vertex_count, triangle_count, vec3_bytes, index_bytes, min, max);
+        file.seekp((std::streamoff) json_offset);
+        file.write(bounded.data(), bounded.size());
+    }
+
+    return (bool) file;
+}
@@ -0,0 +1,561 @@
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+#include "../includes/hierarchical.h"
+#include "../includes/radiosity.h"
+#include "../includes/utils.h"
+
+const float PI = 3.1415926f;
+
+inline float luminance(const glm::vec3 &c) {
+    return 0.2126f * c.r + 0.7152f * c.g + 0.0722f * c.b;
+}
+
+inline glm::vec3 emission(const scene &sc, std::uint32_t p) {
+    std::uint16_t m = sc.material[p];
+    return glm::vec3(sc.emit[0][m], sc.emit[1][m], sc.emit[2][m]);
+}
+
+inline glm::vec3 reflectance(const scene &sc, std::uint32_t p) {
+    std::uint16_t m = sc.material[p];
+    return glm::vec3(sc.color[0][m], sc.color[1][m], sc.color[2][m]);
+}
+
+element patch_element(const glm::vec3 *vertices, float area, std::uint32_t patch) {
+    element e = {};
+    int n = (vertices[3] != vertices[2]) ? 4 : 3;
+
+    std::copy(vertices, vertices + MAX_CORNERS, e.vertices);
+    e.center = glm::vec3(0.0f);
+    e.radius = 0.0f;
+
+    for (int v = 0; v < n; v++) {
+        e.center += vertices[v] / (float) n;
+    }
+
+    for (int v = 0; v < n; v++) {
+        e.radius = glm::max(e.radius, glm::length(vertices[v] - e.center));
+    }
+
+    e.area = area;
+    e.split = quad_split(vertices);
+    e.patch = patch;
+    e.count = 1;
+
+    return e;
+}
+
+/* Top-down median split of the patch centroids. Patches are the leaves, every
+ * cluster is bounded by a sphere around its two children */
+std::uint32_t build_clusters(hierarchy &h, std::uint32_t begin, std::uint32_t end) {
+    if (end - begin == 1) {
+        h.elements[h.order[begin]].first = begin;
+        return h.order[begin];
+    }
+
+    glm::vec3 min = h.elements[h.order[begin]].center;
+    glm::vec3 max = min;
+
+    for (std::uint32_t i = begin; i < end; i++) {
+        min = glm::min(min, h.elements[h.order[i]].center);
+        max = glm::max(max, h.elements[h.order[i]].center);
+    }
+
+    glm::vec3 extent = max - min;
+    int axis = 0;
+    if (extent.y > extent[axis]) { axis = 1; }
+    if (extent.z > extent[axis]) { axis = 2; }
+
+    std::uint32_t mid = (begin + end) / 2;
+    std::nth_element(h.order.begin() + begin, h.order.begin() + mid, h.order.begin() + end,
+                     [&h, axis](std::uint32_t a, std::uint32_t b) {
+                         return h.elements[a].center[axis] < h.elements[b].center[axis];
+                     });
+
+    std::uint32_t left = build_clusters(h, begin, mid);
+    std::uint32_t right = build_clusters(h, mid, end);
+
+    const element &l = h.elements[left];
+    const element &r = h.elements[right];
+
+    element c = {};
+    c.patch = NO_PATCH;
+    c.first = begin;
+    c.count = end - begin;
+    c.children[0] = left;
+    c.children[1] = right;
+    c.children_num = 2;
+    c.area = l.area + r.area;
+    c.B = (l.area * l.B + r.area * r.B) / glm::max(c.area, 1e-12f);
+    c.peak = glm::max(l.peak, r.peak);
+
+    glm::vec3 d = r.center - l.center;
+    float dist = glm::length(d);
+
+    if (dist + r.radius <= l.radius) {
+        c.center = l.center;
+        c.radius = l.radius;
+    } else if (dist + l.radius <= r.radius) {
+        c.center = r.center;
+        c.radius = r.radius;
+    } else {
+        c.radius = 0.5f * (dist + l.radius + r.radius);
+        c.center = l.center + d * ((c.radius - l.radius) / dist);
+    }
+
+    h.elements.push_back(c);
+
+    return (std::uint32_t) h.elements.size() - 1;
+}
+
+inline bool can_split(const hierarchy &h, const element &e) {
+    return e.children_num > 0 || e.area * 0.25f >= h.min_area;
+}
+
+/* 1:4 midpoint split of a patch element, children start with the parent radiosity */
+void split(hierarchy &h, std::uint32_t id) {
+    if (h.elements[id].children_num > 0) {
+        return;
+    }
+
+    const element e = h.elements[id];
+    const glm::vec3 *v = e.vertices;
+    glm::vec3 quarters[4][MAX_CORNERS];
+
+    if (v[3] != v[2]) {
+        glm::vec3 m[4];
+        for (int i = 0; i < 4; i++) {
+            m[i] = 0.5f * (v[i] + v[(i + 1) % 4]);
+        }
+
+        for (int i = 0; i < 4; i++) {
+            quarters[i][0] = v[i];
+            quarters[i][1] = m[i];
+            quarters[i][2] = e.center;
+            quarters[i][3] = m[(i + 3) % 4];
+        }
+    } else {
+        glm::vec3 m01 = 0.5f * (v[0] + v[1]);
+        glm::vec3 m12 = 0.5f * (v[1] + v[2]);
+        glm::vec3 m20 = 0.5f * (v[2] + v[0]);
+
+        const glm::vec3 corners[4][3] = {
+                {v[0], m01,  m20},
+                {m01,  v[1], m12},
+                {m20,  m12,  v[2]},
+                {m01,  m12,  m20}
+        };
+
+        for (int i = 0; i < 4; i++) {
+            std::copy(corners[i], corners[i] + 3, quarters[i]);
+            quarters[i][3] = corners[i][2];
+        }
+    }
+
+    for (int c = 0; c < 4; c++) {
+        element child = patch_element(quarters[c], quad_area(quarters[c]), e.patch);
+        child.B = e.B;
+        child.normal = e.normal;
+        child.peak = e.peak;
+        h.elements[id].children[c] = (std::uint32_t) h.elements.size();
+        h.elements.push_back(child);
+    }
+
+    h.elements[id].children_num = 4;
+}
+
+/* Cosine towards a direction. A cluster can hold patches facing any way, so it
+ * only gets the upper bound, the link samples see the cosines of its patches */
+inline float projected(const element &e, const glm::vec3 &d) {
+    return e.patch != NO_PATCH ? glm::dot(e.normal, d) : 1.0f;
+}
+
+/* Unoccluded point-to-disc estimate between element centers, for the oracle */
+float estimate(const element &receiver, const element &source) {
+    glm::vec3 d = source.center - receiver.center;
+    float dist2 = glm::dot(d, d);
+
+    if (dist2 < 1e-12f) {
+        return 0.0f;
+    }
+
+    d /= glm::sqrt(dist2);
+
+    float cos_r = projected(receiver, d);
+    float cos_s = projected(source, -d);
+
+    if (cos_r <= 0.0f || cos_s <= 0.0f) {
+        return 0.0f;
+    }
+
+    return glm::min(1.0f, cos_r * cos_s * source.area / (PI * dist2 + source.area));
+}
+
+inline bool separated(const element &a, const element &b) {
+    return glm::length(b.center - a.center) > a.radius + b.radius;
+}
+
+/* True if b lies entirely on or behind the plane of the patch element a */
+bool behind(const element &a, const element &b) {
+    if (a.patch == NO_PATCH) {
+        return false;
+    }
+
+    if (b.patch == NO_PATCH) {
+        return glm::dot(a.normal, b.center - a.center) <= -b.radius;
+    }
+
+    for (const auto &v : b.vertices) {
+        if (glm::dot(a.normal, v - a.center) > 1e-4f * a.radius) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* BF oracle, bounded by the brightest part of the source. The point estimate
+ * is only trusted for elements that are well apart */
+inline bool accept(const hierarchy &h, const element &receiver, const element &source, float F) {
+    float BF = source.peak * F;
+    return BF < h.eps && (separated(receiver, source) || BF == 0.0f);
+}
+
+/* Uniform random point of the element and the patch it lies on. A cluster picks
+ * one of its patches by area, so every part of its surface is equally likely */
+glm::vec3 sample(const hierarchy &h, const scene &sc, const element &e, std::uint32_t &patch) {
+    if (e.patch != NO_PATCH) {
+        patch = e.patch;
+        return sample_quad(e.vertices, e.split);
+    }
+
+    auto first = h.cumulative.begin() + e.first;
+    auto last = first + (e.count - 1);
+    double before = e.first > 0 ? first[-1] : 0.0;
+    double x = before + unilateral(mt) * (*last - before);
+
+    patch = h.order[std::upper_bound(first, last, x) - h.cumulative.begin()];
+
+    return sample_quad(corners(sc, patch).vertices, sc.split[patch]);
+}
+
+/* True if a point on its patch lies in the patch element */
+bool inside(const element &e, const glm::vec3 &point) {
+    int n = (e.vertices[3] != e.vertices[2]) ? 4 : 3;
+    float first = 0.0f;
+
+    for (int i = 0; i < n; i++) {
+        const glm::vec3 &a = e.vertices[i];
+        const glm::vec3 &b = e.vertices[(i + 1) % n];
+        float side = glm::dot(e.normal, glm::cross(b - a, point - a));
+
+        if (side * first < 0.0f) {
+            return false;
+        }
+
+        if (first == 0.0f) {
+            first = side;
+        }
+    }
+
+    return true;
+}
+
+/* True if the point of patch p belongs to the element */
+bool contains(const hierarchy &h, std::uint32_t id, std::uint32_t p, const glm::vec3 &point) {
+    const element &e = h.elements[id];
+
+    if (e.patch == NO_PATCH) {
+        std::uint32_t i = h.elements[p].first;
+        return i >= e.first && i < e.first + e.count;
+    }
+
+    return p == e.patch && (id == p || inside(e, point));
+}
+
+/* Form factor with visibility from HR_LINK_SAMPLES pairs of samples at random receiver
+ * points: a point of the source, which finds small far sources, and a cosine-weighted
+ * ray, which finds large close ones. The balance heuristic weighs the two, so neither
+ * needs a cut-off near the receiver. Cluster sources keep what each sample gives per patch */
+link make_link(hierarchy &h, const scene &sc, std::uint32_t r, std::uint32_t s,
+               const scene_bvh &world, float ERR) {
+    const element &receiver = h.elements[r];
+    const element &source = h.elements[s];
+    const glm::vec3 &normal = receiver.normal;
+    bool cluster = source.patch == NO_PATCH;
+    float lift = 1e-4f * glm::sqrt(sc.area[receiver.patch]);
+
+    link l = {s, 0.0f, (std::uint32_t) h.samples.size(), 0};
+
+    /* Both densities are per solid angle, the area one goes with the squared distance */
+    auto add = [&](std::uint32_t p, float cos_x, float cos_y, float dist2) {
+        float F = (cos_x / PI) / (dist2 / (source.area * cos_y) + cos_x / PI) / HR_LINK_SAMPLES;
+        l.F += F;
+
+        if (cluster) {
+            h.samples.push_back({p, F});
+            ++l.count;
+        }
+    };
+
+    for (int k = 0; k < HR_LINK_SAMPLES; k++) {
+        std::uint32_t p_x, p_y;
+        glm::vec3 x = sample(h, sc, receiver, p_x);
+        glm::vec3 y = sample(h, sc, source, p_y);
+        glm::vec3 d = y - x;
+        float dist2 = glm::dot(d, d);
+
+        if (dist2 > ERR * ERR) {
+            float dist = glm::sqrt(dist2);
+            d /= dist;
+
+            float cos_x = glm::dot(normal, d);
+            float cos_y = -glm::dot(sc.normal[p_y], d);
+
+            if (cos_x > 0.0f && cos_y > 0.0f) {
+                /* Start slightly off the surface so the ray does not hit its own patch */
+                ray ray_xy = {x + d * (1e-3f * dist), d};
+                hit nearest = intersect(ray_xy, world, ERR);
+
+                if (!nearest.hit || nearest.t > dist * (1.0f - 2e-3f)) {
+                    add(p_y, cos_x, cos_y, dist2);
+                }
+            }
+        }
+
+        ray around = {x + lift * normal, sample_hemi(normal)};
+        hit nearest = intersect(around, world, ERR);
+
+        if (nearest.hit && nearest.id != receiver.patch) {
+            float cos_y = -glm::dot(sc.normal[nearest.id], around.direction);
+            glm::vec3 point = around.origin + nearest.t * around.direction;
+
+            if (cos_y > 0.0f && contains(h, s, nearest.id, point)) {
+                add(nearest.id, glm::dot(normal, around.direction), cos_y, nearest.t * nearest.t);
+            }
+        }
+    }
+
+    return l;
+}
+
+/* Link the receiver to the source, or split the larger of the two and recurse */
+void refine(hierarchy &h, const scene &sc, std::uint32_t r, std::uint32_t s,
+            const scene_bvh &world, float ERR) {
+
+    if (r == s) {
+        if (h.elements[r].patch != NO_PATCH) {
+            return; // a flat element does not see itself
+        }
+
+        const element e = h.elements[r];
+
+        for (std::uint32_t i = 0; i < e.children_num; i++) {
+            for (std::uint32_t j = 0; j < e.children_num; j++) {
+                refine(h, sc, e.children[i], e.children[j], world, ERR);
+            }
+        }
+
+        return;
+    }
+
+    /* Clusters only send light, their patches receive it */
+    if (h.elements[r].patch == NO_PATCH) {
+        const element e = h.elements[r];
+        for (std::uint32_t c = 0; c < e.children_num; c++) {
+            refine(h, sc, e.children[c], s, world, ERR);
+        }
+        return;
+    }
+
+    const element &receiver = h.elements[r];
+    const element &source = h.elements[s];
+    float F = estimate(receiver, source);
+
+    bool split_r = can_split(h, receiver);
+    bool split_s = can_split(h, source);
+
+    /* Facing away at the centers may still leave a part visible, then split further
+     * or let the link samples find it */
+    if (F <= 0.0f && (behind(receiver, source) || behind(source, receiver))) {
+        return;
+    }
+
+    if ((F > 0.0f && accept(h, receiver, source, F)) || (!split_r && !split_s)) {
+        link l = make_link(h, sc, r, s, world, ERR);
+        if (l.F > 0.0f) {
+            h.elements[r].links.push_back(l);
+        }
+        return;
+    }
+
+    if (split_r && (!split_s || receiver.radius >= source.radius)) {
+        split(h, r);
+        const element e = h.elements[r];
+        for (std::uint32_t c = 0; c < e.children_num; c++) {
+            refine(h, sc, e.children[c], s, world, ERR);
+        }
+    } else {
+        split(h, s);
+        const element e = h.elements[s];
+        for (std::uint32_t c = 0; c < e.children_num; c++) {
+            refine(h, sc, r, e.children[c], world, ERR);
+        }
+    }
+}
+
+/* Drop the links that fail the oracle with the current radiosity and refine them again */
+std::size_t relink(hierarchy &h, const scene &sc, const scene_bvh &world, float ERR) {
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> pending;
+
+    for (std::uint32_t r = 0; r < h.elements.size(); r++) {
+        auto &links = h.elements[r].links;
+
+        auto last = std::remove_if(links.begin(), links.end(), [&](const link &l) {
+            const element &receiver = h.elements[r];
+            const element &source = h.elements[l.source];
+
+            if ((!can_split(h, receiver) && !can_split(h, source)) ||
+                accept(h, receiver, source, estimate(receiver, source))) {
+                return false;
+            }
+
+            pending.emplace_back(r, l.source);
+            return true;
+        });
+
+        links.erase(last, links.end());
+    }
+
+    for (const auto &pair : pending) {
+        refine(h, sc, pair.first, pair.second, world, ERR);
+    }
+
+    return pending.size();
+}
+
+/* Jacobi gather over all links, from the previous radiosity */
+void gather(hierarchy &h) {
+    for (auto &e : h.elements) {
+        e.gathered = glm::vec3(0.0f);
+
+        for (const auto &l : e.links) {
+            if (l.count == 0) {
+                e.gathered += l.F * h.elements[l.source].B;
+            }
+
+            for (std::uint32_t k = l.first; k < l.first + l.count; k++) {
+                e.gathered += h.samples[k].F * h.elements[h.samples[k].patch].B;
+            }
+        }
+    }
+}
+
+/* Push the gathered irradiance down to the leaves, pull the area-weighted radiosity back up.
+ * Clusters gather nothing, so only the elements of a patch pass irradiance on */
+glm::vec3 push_pull(hierarchy &h, const scene &sc, std::uint32_t id, glm::vec3 down) {
+    element &e = h.elements[id];
+    down += e.gathered;
+
+    if (e.children_num == 0) {
+        e.B = emission(sc, e.patch) + reflectance(sc, e.patch) * down;
+        e.peak = luminance(e.B);
+        return e.B;
+    }
+
+    glm::vec3 B(0.0f);
+    e.peak = 0.0f;
+
+    for (std::uint32_t c = 0; c < e.children_num; c++) {
+        const element &child = h.elements[e.children[c]];
+        B += child.area * push_pull(h, sc, e.children[c], down);
+        e.peak = glm::max(e.peak, child.peak);
+    }
+
+    e.B = e.area > 0.0f ? B / e.area : glm::vec3(0.0f);
+
+    return e.B;
+}
+
+/* Hierarchical radiosity with clustering (Hanrahan et al. 1991, Smits et al. 1994).
+ * Patch results land in p_total like with the local line solver */
+void hierarchical(scene &sc, const settings &s, const scene_bvh &world, stats &stat) {
+    stat.events[EVENT::SIJIA_BEGIN] = glfwGetTime();
+
+    hierarchy h = {};
+    float total_area = 0.0f;
+    float max_emit = 0.0f;
+
+    for (std::uint32_t p = 0; p < sc.size; p++) {
+        element e = patch_element(corners(sc, p).vertices, sc.area[p], p);
+        e.B = emission(sc, p);
+        e.normal = sc.normal[p];
+        e.peak = luminance(e.B);
+        h.elements.push_back(e);
+
+        total_area += sc.area[p];
+        max_emit = glm::max(max_emit, luminance(e.B));
+    }
+
+    h.eps = HR_BF_EPS * max_emit;
+    h.min_area = HR_MIN_AREA * total_area;
+    h.order.resize(sc.size);
+    std::iota(h.order.begin(), h.order.end(), 0);
+
+    int iteration_count = 0;
+
+    if (sc.size > 0) {
+        h.root = build_clusters(h, 0, sc.size);
+
+        h.cumulative.resize(sc.size);
+        double area = 0.0;
+        for (std::uint32_t i = 0; i < sc.size; i++) {
+            area += sc.area[h.order[i]];
+            h.cumulative[i] = area;
+        }
+
+        if (s.verbose) { std::cout << "Linking... " << std::flush; }
+        refine(h, sc, h.root, h.root, world, s.ERR);
+
+        for (int round = 0;; round++) {
+            for (int i = 0; i < HR_MAX_GATHERS; i++) {
+                float before = luminance(h.elements[h.root].B);
+
+                gather(h);
+                push_pull(h, sc, h.root, glm::vec3(0.0f));
+                ++iteration_count;
+
+                float after = luminance(h.elements[h.root].B);
+                if (glm::abs(after - before) <= HR_TOLERANCE * after) {
+                    break;
+                }
+            }
+
+            if (round + 1 == HR_REFINE_ROUNDS || relink(h, sc, world, s.ERR) == 0) {
+                break;
+            }
+        }
+
+        if (s.verbose) {
+            std::size_t links_count = 0;
+            for (const auto &e : h.elements) { links_count += e.links.size(); }
+            std::cout << h.elements.size() << " elements, " << links_count << " links" << std::endl;
+        }
+    }
+
+    for (int wave_len = 0; wave_len < 3; wave_len++) {
+        for (std::uint32_t p = 0; p < sc.size; p++) {
+            sc.p_total[wave_len][p] = h.elements[p].B[wave_len] * sc.area[p];
+            sc.p_unshot[wave_len][p] = 0.0f;
+            sc.p_recieved[wave_len][p] = 0.0f;
+        }
+    }
+
+    vertex_radiosity(sc);
+
+    stat.events[EVENT::SIJIA_END] = glfwGetTime();
+    stat.iterations_number = iteration_count;
+}
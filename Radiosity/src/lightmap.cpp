@@ -0,0 +1,290 @@
+#include "../includes/lightmap.h"
+#include "../includes/radiosity.h"
+#include "../includes/utils.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+
+const float LIGHTMAP_FILL = 0.7f;  // first guess of how much of the atlas the charts cover
+const float LIGHTMAP_GROW = 1.1f;  // texel size step while the charts do not fit
+const int LIGHTMAP_MAX_GROW = 128; // steps before giving up, 1.1^128 is over 10^5 times the first guess
+
+struct chart {
+    glm::vec3 origin; // first corner
+    glm::vec3 u, v;   // in the patch plane
+    glm::vec2 corner[MAX_CORNERS]; // along u, v
+    glm::vec2 min, size; // extent along u, v in world units
+    int w, h; // texels, gutter included
+    int x, y; // placement in the atlas
+};
+
+inline glm::vec2 flatten(const chart &c, const glm::vec3 &p) {
+    return {glm::dot(p - c.origin, c.u), glm::dot(p - c.origin, c.v)};
+}
+
+std::vector<chart> make_charts(const scene &sc) {
+    std::vector<chart> charts(sc.size);
+
+    for (std::uint32_t p = 0; p < sc.size; p++) {
+        quad q = corners(sc, p);
+        const glm::vec3 *vertices = q.vertices;
+        chart &c = charts[p];
+
+        c.origin = vertices[0];
+        c.u = glm::normalize(vertices[1] - vertices[0]);
+        c.v = glm::normalize(glm::cross(sc.normal[p], c.u));
+
+        glm::vec2 min(INF), max(-INF);
+        for (int k = 0; k < MAX_CORNERS; k++) {
+            c.corner[k] = flatten(c, vertices[k]);
+            min = glm::min(min, c.corner[k]);
+            max = glm::max(max, c.corner[k]);
+        }
+
+        c.min = min;
+        c.size = max - min;
+    }
+
+    return charts;
+}
+
+inline float cross(const glm::vec2 &a, const glm::vec2 &b) {
+    return a.x * b.y - a.y * b.x;
+}
+
+/* Nearest point of the (convex) patch, texels off the patch would otherwise gather from
+ * behind the walls around it and bleed into the patch when filtered */
+glm::vec2 clamp_to_chart(const chart &c, const glm::vec2 &l) {
+    bool inside = true;
+    float side = 0.0f;
+    glm::vec2 nearest = l;
+    float nearest_dist = INF;
+
+    for (int k = 0; k < MAX_CORNERS; k++) {
+        glm::vec2 a = c.corner[k];
+        glm::vec2 b = c.corner[(k + 1) % MAX_CORNERS];
+        glm::vec2 ab = b - a;
+        float len2 = glm::dot(ab, ab);
+
+        if (len2 <= 0.0f) { continue; } // repeated corner of a triangle
+
+        float turn = cross(ab, l - a);
+        if (turn != 0.0f) {
+            inside = inside && (side == 0.0f || (turn > 0.0f) == (side > 0.0f));
+            side = turn;
+        }
+
+        float t = glm::clamp(glm::dot(l - a, ab) / len2, 0.0f, 1.0f);
+        glm::vec2 on_edge = a + t * ab;
+        float dist = glm::dot(l - on_edge, l - on_edge);
+
+        if (dist < nearest_dist) {
+            nearest_dist = dist;
+            nearest = on_edge;
+        }
+    }
+
+    return inside ? l : nearest;
+}
+
+/* Shelf packing, tallest charts first. Returns the atlas height */
+int pack(std::vector<chart> &charts, const std::vector<std::uint32_t> &order, float texel, int width) {
+    for (auto &c : charts) {
+        c.w = (int) std::ceil(c.size.x / texel) + 2 * LIGHTMAP_GUTTER;
+        c.h = (int) std::ceil(c.size.y / texel) + 2 * LIGHTMAP_GUTTER;
+    }
+
+    int x = 0, y = 0, shelf = 0;
+
+    for (auto p : order) {
+        chart &c = charts[p];
+
+        if (c.w > width) {
+            return std::numeric_limits<int>::max();
+        }
+
+        if (x + c.w > width) {
+            x = 0;
+            y += shelf;
+            shelf = 0;
+        }
+
+        c.x = x;
+        c.y = y;
+        x += c.w;
+        shelf = std::max(shelf, c.h);
+    }
+
+    return y + shelf;
+}
+
+bool bake_lightmap(const scene &sc, const scene_bvh &world, float ERR, lightmap &map) {
+    map = {};
+    map.width = LIGHTMAP_SIZE;
+
+    /* Each chart takes at least one texel plus its gutter, however large the texels get */
+    const std::size_t smallest = (1 + 2 * LIGHTMAP_GUTTER) * (1 + 2 * LIGHTMAP_GUTTER);
+    if (sc.size * smallest > (std::size_t) LIGHTMAP_SIZE * LIGHTMAP_SIZE) {
+        std::cerr << sc.size << " patches do not fit a " << LIGHTMAP_SIZE << "x" << LIGHTMAP_SIZE
+                  << " lightmap" << std::endl;
+        return false;
+    }
+
+    std::vector<chart> charts = make_charts(sc);
+
+    /* Sorting by world height keeps the order the same for every texel size */
+    std::vector<std::uint32_t> order(sc.size);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&charts](std::uint32_t a, std::uint32_t b) {
+        return charts[a].size.y > charts[b].size.y;
+    });
+
+    float total = 0.0f;
+    for (const auto &c : charts) {
+        total += c.size.x * c.size.y;
+    }
+
+    map.texel = glm::max(std::sqrt(total / (LIGHTMAP_FILL * LIGHTMAP_SIZE * LIGHTMAP_SIZE)), ERR);
+    int steps = 0;
+    while ((map.height = pack(charts, order, map.texel, map.width)) > LIGHTMAP_SIZE) {
+        map.texel *= LIGHTMAP_GROW;
+        if (++steps > LIGHTMAP_MAX_GROW || !std::isfinite(map.texel)) {
+            std::cerr << "Charts do not fit a " << LIGHTMAP_SIZE << "x" << LIGHTMAP_SIZE << " lightmap" << std::endl;
+            map = {};
+            return false;
+        }
+    }
+
+    map.height = std::max(map.height, 1);
+
+    /* Which chart each texel belongs to */
+    std::vector<std::int32_t> owner((std::size_t) map.width * map.height, -1);
+    for (std::uint32_t p = 0; p < sc.size; p++) {
+        const chart &c = charts[p];
+        for (int y = c.y; y < c.y + c.h; y++) {
+            std::fill(&owner[(std::size_t) y * map.width + c.x], &owner[(std::size_t) y * map.width + c.x + c.w], p);
+        }
+    }
+
+    map.uv.resize(MAX_CORNERS * sc.size);
+    for (std::uint32_t p = 0; p < sc.size; p++) {
+        const chart &c = charts[p];
+        quad q = corners(sc, p);
+        const glm::vec3 *vertices = q.vertices;
+
+        for (int k = 0; k < MAX_CORNERS; k++) {
+            glm::vec2 texel = glm::vec2(c.x + LIGHTMAP_GUTTER, c.y + LIGHTMAP_GUTTER) +
+                              (flatten(c, vertices[k]) - c.min) / map.texel;
+            map.uv[MAX_CORNERS * p + k] = texel / glm::vec2(map.width, map.height);
+        }
+    }
+
+    std::vector<glm::vec3> radiosity(sc.size);
+    for (std::uint32_t p = 0; p < sc.size; p++) {
+        for (int wave_len = 0; wave_len < 3; wave_len++) {
+            radiosity[p][wave_len] = sc.p_total[wave_len][p] / sc.area[p];
+        }
+    }
+
+    map.texels.assign((std::size_t) map.width * map.height, glm::vec3(0.0f));
+
+    int tiles_x = (map.width + LIGHTMAP_TILE - 1) / LIGHTMAP_TILE;
+    int tiles_y = (map.height + LIGHTMAP_TILE - 1) / LIGHTMAP_TILE;
+
+    parallel_items((std::size_t) tiles_x * tiles_y, [&](std::size_t item, std::size_t) {
+        /* Seeded by tile, so the atlas does not depend on the thread count */
+        auto tile = (int) item;
+        std::mt19937 gen((std::uint32_t) tile);
+
+        int x0 = (tile % tiles_x) * LIGHTMAP_TILE;
+        int y0 = (tile / tiles_x) * LIGHTMAP_TILE;
+
+        for (int y = y0; y < std::min(y0 + LIGHTMAP_TILE, map.height); y++) {
+            for (int x = x0; x < std::min(x0 + LIGHTMAP_TILE, map.width); x++) {
+                std::int32_t p = owner[(std::size_t) y * map.width + x];
+                if (p < 0) { continue; }
+
+                /* Gutter texels and the rest of the box around the patch repeat its border */
+                const chart &c = charts[p];
+                glm::vec2 l = c.min + (glm::vec2(x - c.x - LIGHTMAP_GUTTER, y - c.y - LIGHTMAP_GUTTER) + 0.5f) *
+                                      map.texel;
+                l = clamp_to_chart(c, l);
+
+                float lift = 1e-4f * glm::sqrt(sc.area[p]);
+                glm::vec3 origin = c.origin + l.x * c.u + l.y * c.v + lift * sc.normal[p];
+
+                glm::vec3 gathered(0.0f);
+                for (int i = 0; i < LIGHTMAP_SAMPLES; i++) {
+                    ray sample = {origin, sample_hemi(sc.normal[p], gen)};
+                    hit nearest = intersect(sample, world, ERR);
+
+                    /* Patches only give off light on their front side */
+                    if (nearest.hit && nearest.id != (std::uint32_t) p &&
+                        glm::dot(sample.direction, sc.normal[nearest.id]) < 0.0f) {
+                        gathered += radiosity[nearest.id];
+                    }
+                }
+
+                glm::vec3 &texel = map.texels[(std::size_t) y * map.width + x];
+                for (int wave_len = 0; wave_len < 3; wave_len++) {
+                    texel[wave_len] = emittance(sc, wave_len, p) +
+                                      reflectance(sc, wave_len, p) * gathered[wave_len] / LIGHTMAP_SAMPLES;
+                }
+            }
+        }
+    });
+
+    return true;
+}
+
+bool save_hdr(const std::string &path, const lightmap &map) {
+    std::ofstream file(path.c_str(), std::ios::out | std::ios::binary);
+    if (!file) {
+        std::cerr << "Cannot write " << path << std::endl;
+        return false;
+    }
+
+    file << "#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y " << map.height << " +X " << map.width << "\n";
+
+    /* Flat scanlines, top row first */
+    std::vector<std::uint8_t> row(4 * map.width);
+
+    for (int y = map.height - 1; y >= 0; y--) {
+        for (int x = 0; x < map.width; x++) {
+            const glm::vec3 &c = map.texels[(std::size_t) y * map.width + x];
+            float brightest = glm::max(c.r, glm::max(c.g, c.b));
+            std::uint8_t *rgbe = &row[4 * x];
+
+            if (brightest < 1e-32f) {
+                rgbe[0] = rgbe[1] = rgbe[2] = rgbe[3] = 0;
+            } else {
+                int exponent;
+                float scale = std::frexp(brightest, &exponent) * 256.0f / brightest;
+
+                rgbe[0] = (std::uint8_t) (c.r * scale);
+                rgbe[1] = (std::uint8_t) (c.g * scale);
+                rgbe[2] = (std::uint8_t) (c.b * scale);
+                rgbe[3] = (std::uint8_t) (exponent + 128);
+            }
+        }
+
+        file.write((const char *) row.data(), row.size());
+    }
+
+    return (bool) file;
+}
+
+bool save_uv(const std::string &path, const lightmap &map) {
+    std::ofstream file(path.c_str(), std::ios::out | std::ios::binary);
+    if (!file) {
+        std::cerr << "Cannot write " << path << std::endl;
+        return false;
+    }
+
+    file.write((const char *) map.uv.data(), map.uv.size() * sizeof(glm::vec2));
+
+    return (bool) file;
+}
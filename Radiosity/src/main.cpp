@@ -4,6 +4,12 @@
 #include "../includes/radiosity.h"
 #include "../includes/bvh.h"
 #include "../includes/stats.h"
+#include "../includes/bench.h"
+#include "../includes/refine.h"
+#include "../includes/hierarchical.h"
+#include "../includes/pack.h"
+#include "../includes/result.h"
+#include "../includes/lightmap.h"
 
 camera *cam;
 bool keys[1024] = {};
@@ -12,6 +18,18 @@ bool first_call = true;
 double last_x, last_y;
 
 static std::atomic<bool> finished_radiosity(false);
+static std::atomic<bool> solving(false); // the compute thread owns the scene until it is done
+
+const float EXPOSURE_STEP = 1.25f;
+const float GAMMA_STEP = 0.1f;
+const float DISPLAY_GAMMA = 2.2f;
+float exposure = 1.0f;               // scales the tone mapping key, - and = keys
+float display_gamma = DISPLAY_GAMMA; // [ and ] keys
+TONEMAP_OPERATOR tonemap_op = TONEMAP_REINHARD; // H key
+
+const float LIGHT_STEP = 2.0f;
+int selected_light = 0;   // L key, counts through the emitting materials
+float light_scale = 1.0f; // , and . keys, applied to the selected light before the next solve
 
 /* Cursor movement fires this callback */
 void cursor_pos_callback(GLFWwindow *window, double xpos, double ypos) {
@@ -49,6 +67,31 @@ void key_callback(GLFWwindow *window, int key, int scancode, int action, int mod
 //                std::cout << "Interactive camera mode "
 //                          << (cam_interactive ? "ENABLED" : "DISABLED")
 //                          << std::endl;
+                break;
+            case GLFW_KEY_EQUAL:
+                exposure *= EXPOSURE_STEP;
+                break;
+            case GLFW_KEY_MINUS:
+                exposure /= EXPOSURE_STEP;
+                break;
+            case GLFW_KEY_RIGHT_BRACKET:
+                display_gamma += GAMMA_STEP;
+                break;
+            case GLFW_KEY_H:
+                tonemap_op = (tonemap_op == TONEMAP_REINHARD) ? TONEMAP_HISTOGRAM : TONEMAP_REINHARD;
+                break;
+            case GLFW_KEY_LEFT_BRACKET:
+                display_gamma = glm::max(display_gamma - GAMMA_STEP, GAMMA_STEP);
+                break;
+            case GLFW_KEY_L:
+                ++selected_light;
+                break;
+            case GLFW_KEY_PERIOD:
+                light_scale *= LIGHT_STEP;
+                break;
+            case GLFW_KEY_COMMA:
+                light_scale /= LIGHT_STEP;
+                break;
             default:
                 break;
         }
@@ -64,64 +107,138 @@ void update(const utils::shader &s) {
     }
 
     s.set_uniform<glm::mat4>("view", cam->view_matrix());
+
+    /* Re-exposing is a few uniforms, the colors on the GPU stay linear */
+    s.set_uniform<float>("exposure", exposure);
+    s.set_uniform<float>("gamma", display_gamma);
+    s.set_uniform<int>("op", (int) tonemap_op);
 }
 
-void startup(std::vector<patch> &patches,
-             std::vector<patch *> &primitives,
-             std::vector<float> &vertices,
-             bvh_node **tree,
+/* Hands the operator to the fragment shader, which maps the linear colors every frame */
+void set_tonemap(const utils::shader &s, const tonemap_params &tm) {
+    s.set_uniform<int>("tonemap", 1);
+    s.set_uniform<int>("mode", (int) tm.mode);
+    s.set_uniform<float>("key", tm.key);
+    s.set_uniform<float>("inv_white_sq", 1.0f / (tm.white * tm.white));
+    s.set_uniform<glm::vec3>("log_average", tm.log_average);
+    s.set_uniform_array("curve", tm.curve, HISTOGRAM_BINS + 1);
+    tonemap_op = tm.op;
+}
+
+void startup(scene &sc,
+             std::vector<instance> &instances,
+             std::vector<float> &colors,
+             std::vector<std::uint32_t> &indices,
+             scene_bvh &tree,
              const settings &s,
              stats &stat,
              GLuint *VAO,
-             GLuint *VBO) {
+             GLuint *VBO,
+             GLuint *CBO,
+             GLuint *EBO) {
 
     stat.events[EVENT::MESH_BEGIN] = glfwGetTime();
 
+    bool packed_bvh = false;
+
     if (s.verbose) { std::cout << "Loading mesh... " << std::flush; }
-    patches = load_mesh(s.mesh_path, stat);
+    if (is_pack(s.mesh_path)) {
+        /* Binary scene from rad-pack, may carry its BVH */
+        if (!load_pack(s.mesh_path, sc, instances, tree, packed_bvh, stat)) {
+            std::exit(1);
+        }
+    } else {
+        sc = load_mesh(s.mesh_path, instances, stat);
+    }
     if (s.verbose) { std::cout << "DONE" << std::endl; }
 
     stat.events[EVENT::MESH_END] = glfwGetTime();
 
-    for (auto &patch : patches) {
-        primitives.push_back(&patch);
-    }
-
     stat.events[EVENT::BVH_BEGIN] = glfwGetTime();
 
-    if (s.verbose) { std::cout << "Creating the BVH... " << std::flush; }
-    *tree = bvh(primitives);
-    if (s.verbose) { std::cout << "DONE" << std::endl; }
+    if (!packed_bvh) {
+        if (s.verbose) { std::cout << "Creating the BVH... " << std::flush; }
+        tree = bvh(sc, instances);
+        if (s.verbose) { std::cout << "DONE" << std::endl; }
+    }
 
     stat.events[EVENT::BVH_END] = glfwGetTime();
 
     if (s.verbose) { std::cout << "Initializing OpenGL buffers... " << std::flush; }
-    vertices = glify(primitives, true);
-    init_buffers(VAO, VBO, vertices);
+    colors.assign(3 * sc.vertices.size(), 0.6f);
+    indices = triangles(sc);
+    init_buffers(VAO, VBO, CBO, EBO, sc.vertices, colors, indices);
     if (s.verbose) { std::cout << "DONE" << std::endl; }
 }
 
-void radiate(std::vector<patch> &patches,
-             std::vector<patch *> &primitives,
-             std::vector<float> &vertices,
-             bvh_node **tree,
+void radiate(scene &sc,
+             std::vector<instance> &instances,
+             std::vector<float> &colors,
+             tonemap_params &tm,
+             scene_bvh &tree,
              const settings &s,
              stats &stat) {
 
-    /* Local line radiosity */
-    local_line(primitives, s, *tree, stat);
+    if (s.hierarchical) {
+        /* Hierarchical radiosity */
+        hierarchical(sc, s, tree, stat);
+    } else if (s.adaptive) {
+        /* Coarse local line pass, then refine where it shows strong gradients */
+        settings coarse = s;
+        coarse.TOTAL_RAYS = s.TOTAL_RAYS / 2;
+        local_line(sc, coarse, tree, stat);
 
-    /* Transform to OpenGL per-vertex format */
-    vertices = glify(primitives, false);
+        for (int level = 0; level < REFINE_LEVELS; level++) {
+            if (s.verbose) { std::cout << "Refining... " << std::flush; }
+            auto split_count = refine(sc, instances, REFINE_THRESHOLD);
+            if (s.verbose) { std::cout << split_count << " patches split" << std::endl; }
+
+            if (split_count == 0) { break; }
+
+            tree = bvh(sc, instances);
+            jacobi_iteration(sc, s.TOTAL_RAYS / (2 * REFINE_LEVELS), tree, s.ERR, s.qmc);
+        }
 
-    /* Tone map */
-    if (s.verbose) { std::cout << "Tone mapping... " << std::flush; }
+        stat.events[EVENT::SIJIA_END] = glfwGetTime();
+        stat.polygons_count = sc.size;
+    } else {
+        /* Local line radiosity */
+        local_line(sc, s, tree, stat);
+    }
+
+    if (s.gather) {
+        /* Smooth per-vertex colors from a final gather over the solution, in place of the patch averages */
+        interpolate(sc, tree, GATHER_G_RAYS, GATHER_S_RAYS, s.ERR, s.qmc, s.verbose);
+    }
+
+    /* Pack the linear per-vertex colors, only grows if adaptive meshing added vertices */
+    colors.resize(3 * sc.vertices.size());
+    glify(sc, colors.data());
+
+    /* Only the log-average is left to the CPU, the shader applies the operator */
+    if (s.verbose) { std::cout << "Averaging luminance... " << std::flush; }
     stat.events[EVENT::TONEMAP_BEGIN] = glfwGetTime();
-    reinhard(vertices);
+    tm = REINHARD_DEFAULTS;
+    tm.mode = s.channels ? TONEMAP_CHANNELS : TONEMAP_LUMINANCE;
+    tm.white = s.white ? REINHARD_WHITE : INF;
+    tm.op = s.histogram ? TONEMAP_HISTOGRAM : TONEMAP_REINHARD;
+    tm.log_average = log_average(colors, tm.mode);
+    histogram_curve(colors, tm.curve);
     stat.events[EVENT::TONEMAP_END] = glfwGetTime();
     if (s.verbose) { std::cout << "DONE" << std::endl; }
 
     finished_radiosity = true;
+
+    if (s.bake) {
+        /* Coarse geometry can carry the lighting in a texture instead of its vertices */
+        if (s.verbose) { std::cout << "Baking lightmap... " << std::flush; }
+        lightmap map;
+        if (bake_lightmap(sc, tree, s.ERR, map) && save_hdr(LIGHTMAP_PATH, map) && save_uv(LIGHTMAP_UV_PATH, map)) {
+            if (s.verbose) { std::cout << map.width << "x" << map.height << " DONE" << std::endl; }
+        }
+    }
+
+    solving = false;
 }
 
 int main(int argc, char **argv) {
@@ -165,7 +282,6 @@ int main(int argc, char **argv) {
     glDepthFunc(GL_LESS);
     glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
     glLineWidth(1.5f);
-    glEnable(GL_FRAMEBUFFER_SRGB);
 
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 
@@ -177,39 +293,72 @@ int main(int argc, char **argv) {
     glm::mat4 view = cam->view_matrix();
 
     /* Create a shader program and init uniform variables */
-    utils::shader shader("glsl/pass_3d.vert", "glsl/white.frag");
+    utils::shader shader("glsl/pass_3d.vert", "glsl/tonemap.frag");
     shader.use_program();
     shader.set_uniform<glm::mat4>("proj", proj);
     shader.set_uniform<glm::mat4>("view", view);
+    shader.set_uniform<glm::vec3>("position_offset", glm::vec3(0.0f));
+    shader.set_uniform<glm::vec3>("position_scale", glm::vec3(1.0f));
+    shader.set_uniform<int>("tonemap", 0); // the mesh is drawn as it is until solved
 
-    GLuint VAO, VBO;
+    GLuint VAO, VBO, CBO, EBO;
 
-    std::vector<float> vertices;
-    std::vector<patch> patches;
-    std::vector<patch *> primitives;
-    bvh_node *tree;
+    std::vector<float> colors; // linear solution
+    tonemap_params tm = {};
+    result_file result = {};
+    std::vector<std::uint32_t> indices;
+    scene sc = {};
+    std::vector<instance> instances;
+    scene_bvh tree = {};
 
     std::thread t1;
+    std::size_t uploaded_vertices = 0;
+    std::size_t index_count = 0;
 
     if (s.display_only) {
-        std::ifstream file("models/saved_data.bin", std::ios::binary);
-        file.seekg(0, std::ios::end);
-        std::size_t size = file.tellg();
-        file.seekg(0, std::ios::beg);
-        vertices.resize(size);
-        file.read((char *) vertices.data(), size);
-        init_buffers(&VAO, &VBO, vertices);
+        if (!map_result(RESULT_PATH, result)) {
+            glfwTerminate();
+            delete cam;
+            return 1;
+        }
+
+        /* Linear colors go up as they are stored, the saved tone mapping maps them */
+        index_count = upload_result(result, &VAO, &VBO, &CBO, &EBO);
+        set_tonemap(shader, result_tonemap(result));
+
+        const float *offset = result.header->position_offset;
+        const float *scale = result.header->position_scale;
+        shader.set_uniform<glm::vec3>("position_offset", glm::vec3(offset[0], offset[1], offset[2]));
+        shader.set_uniform<glm::vec3>("position_scale", glm::vec3(scale[0], scale[1], scale[2]));
         glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
     } else {
-        startup(patches, primitives, vertices, &tree, s, stat, &VAO, &VBO);
-
-        /* Radiosity and tone-mapping thread */
-        t1 = std::thread(radiate,
-                         std::ref(patches),
-                         std::ref(primitives),
-                         std::ref(vertices),
-                         &tree, s,
-                         std::ref(stat));
+        startup(sc, instances, colors, indices, tree, s, stat, &VAO, &VBO, &CBO, &EBO);
+        uploaded_vertices = sc.vertices.size();
+        index_count = indices.size();
+
+        if (s.bench || s.bench_sampling) {
+            if (s.bench) {
+                bench_layouts(sc, tree, s);
+                bench_solvers(sc, tree, s);
+                if (s.gather) {
+                    bench_gather(sc, tree, s);
+                }
+            }
+            if (s.bench_sampling) {
+                bench_sampling(sc, tree, s);
+            }
+            glfwSetWindowShouldClose(window, GL_TRUE);
+        } else {
+            /* Radiosity and tone-mapping thread */
+            solving = true;
+            t1 = std::thread(radiate,
+                             std::ref(sc),
+                             std::ref(instances),
+                             std::ref(colors),
+                             std::ref(tm),
+                             std::ref(tree), s,
+                             std::ref(stat));
+        }
     }
 
     /* Main draw loop */
@@ -220,7 +369,18 @@ int main(int argc, char **argv) {
         update(shader);
 
         if (finished_radiosity) {
-            update_buffers(&VAO, &VBO, vertices);
+            if (sc.vertices.size() != uploaded_vertices) {
+                /* Adaptive meshing split patches, the whole mesh is new */
+                indices = triangles(sc);
+                update_buffers(&VAO, &VBO, &CBO, &EBO, sc.vertices, colors, indices);
+                uploaded_vertices = sc.vertices.size();
+                index_count = indices.size();
+            } else {
+                update_colors(&CBO, colors);
+            }
+
+            set_tonemap(shader, tm);
+
             glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
             finished_radiosity = false;
 
@@ -228,20 +388,53 @@ int main(int argc, char **argv) {
 
             if (s.save_result) {
                 if (s.verbose) { std::cout << "Saving to file... " << std::flush; }
-                std::ofstream file("models/saved_data.bin", std::ios::out | std::ios::binary);
-                file.write((char *) vertices.data(), vertices.size() * sizeof(float));
-                if (s.verbose) { std::cout << "DONE" << std::endl; }
+                bool saved = s.compact ? save_compact_result(RESULT_PATH, sc, colors, indices, s, tm)
+                                       : save_result(RESULT_PATH, sc, colors, indices, s, tm);
+                if (!saved) {
+                    std::cerr << "Result was not saved to " << RESULT_PATH << std::endl;
+                } else if (s.verbose) {
+                    std::cout << "DONE" << std::endl;
+                }
+            }
+        }
+
+        /* A light edit is a material table update and a new solve on the mesh as it is */
+        if (light_scale != 1.0f && !solving && !finished_radiosity && !s.display_only) {
+            std::vector<std::uint16_t> lights = light_materials(sc);
+
+            if (!lights.empty()) {
+                if (t1.joinable()) { t1.join(); }
+
+                std::uint16_t m = lights[selected_light % lights.size()];
+                glm::vec3 color(sc.color[0][m], sc.color[1][m], sc.color[2][m]);
+                glm::vec3 emit(sc.emit[0][m], sc.emit[1][m], sc.emit[2][m]);
+                set_material(sc, m, color, emit * light_scale);
+
+                if (s.verbose) { std::cout << "Light " << sc.material_name[m] << " x" << light_scale << std::endl; }
+
+                settings again = s;
+                again.adaptive = false; // the mesh is already refined
+                solving = true;
+                t1 = std::thread(radiate,
+                                 std::ref(sc),
+                                 std::ref(instances),
+                                 std::ref(colors),
+                                 std::ref(tm),
+                                 std::ref(tree), again,
+                                 std::ref(stat));
             }
+
+            light_scale = 1.0f;
         }
 
         glBindVertexArray(VAO);
-        glDrawArrays(GL_TRIANGLES, 0, vertices.size() / 3);
+        glDrawElements(GL_TRIANGLES, (GLsizei) index_count, GL_UNSIGNED_INT, (GLvoid *) 0);
         glBindVertexArray(0);
 
         glfwSwapBuffers(window);
     }
 
-    if (!s.display_only) {
+    if (t1.joinable()) {
         if (s.verbose) { std::cout << "Compute thread joined" << std::endl; }
         t1.join();
     }
@@ -251,8 +444,12 @@ int main(int argc, char **argv) {
     glBindVertexArray(0);
 
     glDeleteBuffers(1, &VBO);
+    glDeleteBuffers(1, &CBO);
+    glDeleteBuffers(1, &EBO);
     glDeleteVertexArrays(1, &VAO);
 
+    unmap_result(result);
+
     glfwDestroyWindow(window);
     glfwTerminate();
 
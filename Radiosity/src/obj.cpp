@@ -0,0 +1,426 @@
+#include "../includes/obj.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+
+/* Negative OBJ indices count back from the last vertex read. A chunk does not know how
+ * many vertices came before it, so they are stored offset by RELATIVE until the merge */
+const std::int64_t RELATIVE = (std::int64_t) 1 << 40;
+const std::int64_t MISSING = -1;
+const std::int64_t OUT_OF_RANGE = -2;
+
+struct obj_chunk {
+    const char *begin;
+    const char *end;
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec3> normals;
+    std::vector<std::int64_t> corner_vertex;
+    std::vector<std::int64_t> corner_normal;
+    std::vector<std::uint32_t> face_size;
+    std::vector<std::pair<std::uint32_t, std::string>> usemtl; // first local face of the material
+    std::vector<std::uint32_t> shapes; // local face index of each 'o' or 'g' line
+    std::vector<std::string> libraries;
+};
+
+inline bool blank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+inline bool digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+inline const char *skip_blank(const char *s, const char *end) {
+    while (s < end && blank(*s)) { ++s; }
+    return s;
+}
+
+inline bool keyword(const char *s, const char *end, const char *word) {
+    std::size_t len = std::strlen(word);
+    std::size_t rest = (std::size_t) (end - s);
+    return rest >= len && std::memcmp(s, word, len) == 0 && (rest == len || blank(s[len]));
+}
+
+/* Decimal with optional fraction and exponent, without locale or allocation */
+const char *parse_float(const char *s, const char *end, float &out) {
+    static const double POW10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                   1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+    s = skip_blank(s, end);
+
+    bool negative = false;
+    if (s < end && (*s == '-' || *s == '+')) {
+        negative = *s == '-';
+        ++s;
+    }
+
+    /* 19 significant digits fit into 64 bits, the rest only move the exponent */
+    std::uint64_t mantissa = 0;
+    int significant = 0;
+    int exponent = 0;
+
+    for (; s < end && digit(*s); ++s) {
+        if (significant < 19) {
+            mantissa = mantissa * 10 + (*s - '0');
+            significant += mantissa != 0;
+        } else {
+            ++exponent;
+        }
+    }
+
+    if (s < end && *s == '.') {
+        for (++s; s < end && digit(*s); ++s) {
+            if (significant < 19) {
+                mantissa = mantissa * 10 + (*s - '0');
+                significant += mantissa != 0;
+                --exponent;
+            }
+        }
+    }
+
+    if (s < end && (*s == 'e' || *s == 'E')) {
+        bool negative_exponent = false;
+        int value = 0;
+
+        ++s;
+        if (s < end && (*s == '-' || *s == '+')) {
+            negative_exponent = *s == '-';
+            ++s;
+        }
+
+        for (; s < end && digit(*s); ++s) {
+            value = std::min(value * 10 + (*s - '0'), 10000);
+        }
+
+        exponent += negative_exponent ? -value : value;
+    }
+
+    double value = (double) mantissa;
+
+    if (exponent >= 0) {
+        value = (exponent <= 22) ? value * POW10[exponent] : value * std::pow(10.0, exponent);
+    } else {
+        value = (exponent >= -22) ? value / POW10[-exponent] : value * std::pow(10.0, exponent);
+    }
+
+    out = (float) (negative ? -value : value);
+
+    return s;
+}
+
+/* One index of a face corner, 'count' is the number of such elements read so far in the chunk */
+const char *parse_index(const char *s, const char *end, std::int64_t count, std::int64_t &out) {
+    bool negative = false;
+    if (s < end && *s == '-') {
+        negative = true;
+        ++s;
+    }
+
+    std::int64_t value = 0;
+    const char *first = s;
+
+    for (; s < end && digit(*s); ++s) {
+        value = value * 10 + (*s - '0');
+    }
+
+    if (s == first || value == 0) {
+        out = MISSING;
+    } else {
+        out = negative ? RELATIVE + count - value : value - 1;
+    }
+
+    return s;
+}
+
+void parse_chunk(obj_chunk &c) {
+    const char *s = c.begin;
+
+    while (s < c.end) {
+        auto eol = (const char *) std::memchr(s, '\n', c.end - s);
+        if (eol == nullptr) { eol = c.end; }
+
+        s = skip_blank(s, eol);
+
+        if (keyword(s, eol, "v")) {
+            glm::vec3 v;
+            s = parse_float(s + 1, eol, v.x);
+            s = parse_float(s, eol, v.y);
+            parse_float(s, eol, v.z);
+            c.positions.push_back(v);
+        } else if (keyword(s, eol, "vn")) {
+            glm::vec3 n;
+            s = parse_float(s + 2, eol, n.x);
+            s = parse_float(s, eol, n.y);
+            parse_float(s, eol, n.z);
+            c.normals.push_back(n);
+        } else if (keyword(s, eol, "f")) {
+            std::uint32_t size = 0;
+
+            for (s = skip_blank(s + 1, eol); s < eol; s = skip_blank(s, eol)) {
+                std::int64_t vertex, texture, normal = MISSING;
+
+                /* v, v/vt, v//vn or v/vt/vn */
+                const char *corner = s;
+                s = parse_index(s, eol, (std::int64_t) c.positions.size(), vertex);
+                if (s < eol && *s == '/') {
+                    s = parse_index(s + 1, eol, 0, texture);
+                    if (s < eol && *s == '/') {
+                        s = parse_index(s + 1, eol, (std::int64_t) c.normals.size(), normal);
+                    }
+                }
+
+                /* Anything unexpected is skipped up to the next corner */
+                while (s < eol && !blank(*s)) { ++s; }
+                if (s == corner) { break; }
+
+                c.corner_vertex.push_back(vertex);
+                c.corner_normal.push_back(normal);
+                ++size;
+            }
+
+            c.face_size.push_back(size);
+        } else if (keyword(s, eol, "o") || keyword(s, eol, "g")) {
+            c.shapes.push_back((std::uint32_t) c.face_size.size());
+        } else if (keyword(s, eol, "usemtl")) {
+            const char *last = eol;
+            s = skip_blank(s + 6, eol);
+            while (last > s && blank(last[-1])) { --last; }
+            c.usemtl.emplace_back((std::uint32_t) c.face_size.size(), std::string(s, last));
+        } else if (keyword(s, eol, "mtllib")) {
+            std::istringstream names(std::string(s + 6, eol));
+            std::string name;
+            while (names >> name) { c.libraries.push_back(name); }
+        }
+
+        s = eol + 1;
+    }
+}
+
+/* Only the newmtl, Kd and Ka statements matter to the solver */
+bool load_mtl(const std::string &path, std::vector<obj_material> &materials) {
+    std::ifstream file(path.c_str());
+    if (!file) { return false; }
+
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream statement(line);
+        std::string key;
+        statement >> key;
+
+        if (key == "newmtl") {
+            obj_material m = {};
+            statement >> m.name;
+            materials.push_back(m);
+        } else if (key == "Kd" && !materials.empty()) {
+            glm::vec3 &d = materials.back().diffuse;
+            statement >> d.x >> d.y >> d.z;
+        } else if (key == "Ka" && !materials.empty()) {
+            glm::vec3 &e = materials.back().emit;
+            statement >> e.x >> e.y >> e.z;
+        }
+    }
+
+    return true;
+}
+
+/* Copies a parsed chunk to its place in the mesh, false if a corner points nowhere.
+ * 'material' is the one in use when the chunk starts, 'usemtl' holds the ids of its usemtl lines */
+bool merge_chunk(const obj_chunk &c, obj_mesh &mesh,
+                 std::size_t position_base, std::size_t normal_base,
+                 std::size_t face_base, std::size_t corner_base,
+                 std::int32_t material, const std::vector<std::int32_t> &usemtl) {
+
+    std::copy(c.positions.begin(), c.positions.end(), mesh.positions.begin() + position_base);
+    std::copy(c.normals.begin(), c.normals.end(), mesh.normals.begin() + normal_base);
+
+    auto resolve = [](std::int64_t index, std::size_t base, std::size_t count) -> std::int64_t {
+        if (index == MISSING) { return MISSING; }
+        index = (index >= RELATIVE / 2) ? (std::int64_t) base + (index - RELATIVE) : index;
+        return (index >= 0 && index < (std::int64_t) count) ? index : OUT_OF_RANGE;
+    };
+
+    bool valid = true;
+
+    for (std::size_t i = 0; i < c.corner_vertex.size(); i++) {
+        std::int64_t vertex = resolve(c.corner_vertex[i], position_base, mesh.positions.size());
+        std::int64_t normal = resolve(c.corner_normal[i], normal_base, mesh.normals.size());
+
+        valid &= vertex >= 0 && normal != OUT_OF_RANGE;
+
+        mesh.corner_vertex[corner_base + i] = (std::int32_t) vertex;
+        mesh.corner_normal[corner_base + i] = (std::int32_t) normal;
+    }
+
+    std::size_t corner = corner_base;
+    std::size_t next_material = 0;
+
+    for (std::uint32_t f = 0; f < c.face_size.size(); f++) {
+        while (next_material < c.usemtl.size() && c.usemtl[next_material].first == f) {
+            material = usemtl[next_material++];
+        }
+
+        mesh.face_first[face_base + f] = (std::uint32_t) corner;
+        mesh.face_material[face_base + f] = material;
+        corner += c.face_size[f];
+    }
+
+    return valid;
+}
+
+bool load_obj(const std::string &path, obj_mesh &mesh, std::string &err) {
+    mesh = {};
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        err = "Cannot open " + path;
+        return false;
+    }
+
+    struct stat info = {};
+    fstat(fd, &info);
+    auto size = (std::size_t) info.st_size;
+
+    const char *data = nullptr;
+    if (size > 0) {
+        void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (mapped == MAP_FAILED) {
+            close(fd);
+            err = "Cannot map " + path;
+            return false;
+        }
+
+        madvise(mapped, size, MADV_SEQUENTIAL);
+        data = (const char *) mapped;
+    }
+
+    close(fd);
+
+    /* Line-aligned chunks, one per thread */
+    std::size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::max((std::size_t) 1, std::min(threads, size / OBJ_MIN_CHUNK));
+
+    std::vector<obj_chunk> chunks(threads);
+    const char *from = data;
+    const char *end = data + size;
+
+    for (std::size_t i = 0; i < threads; i++) {
+        const char *to = std::max(from, data + size * (i + 1) / threads);
+
+        if (to < end) {
+            auto eol = (const char *) std::memchr(to, '\n', end - to);
+            to = (eol != nullptr) ? eol + 1 : end;
+        }
+
+        chunks[i].begin = from;
+        chunks[i].end = to;
+        from = to;
+    }
+
+    std::vector<std::thread> workers;
+    for (std::size_t i = 1; i < threads; i++) {
+        workers.emplace_back(parse_chunk, std::ref(chunks[i]));
+    }
+
+    parse_chunk(chunks[0]);
+
+    for (auto &worker : workers) {
+        worker.join();
+    }
+
+    if (data != nullptr) {
+        munmap((void *) data, size);
+    }
+
+    /* Materials, a library is looked up as given and then next to the OBJ file */
+    std::unordered_map<std::string, std::int32_t> material_ids;
+    std::string directory = path.substr(0, path.find_last_of('/') + 1);
+
+    for (const auto &c : chunks) {
+        for (const auto &library : c.libraries) {
+            if (!load_mtl(library, mesh.materials) && !load_mtl(directory + library, mesh.materials)) {
+                err += "WARN: Material file [ " + library + " ] not found.\n";
+            }
+        }
+    }
+
+    for (std::size_t m = 0; m < mesh.materials.size(); m++) {
+        material_ids.emplace(mesh.materials[m].name, (std::int32_t) m);
+    }
+
+    auto material_id = [&](const std::string &name) {
+        auto id = material_ids.find(name);
+        return (id != material_ids.end()) ? id->second : -1;
+    };
+
+    /* Where every chunk starts in the merged arrays, and the material it starts with */
+    std::vector<std::size_t> position_base(threads + 1, 0), normal_base(threads + 1, 0);
+    std::vector<std::size_t> face_base(threads + 1, 0), corner_base(threads + 1, 0);
+    std::vector<std::int32_t> first_material(threads + 1, -1);
+    std::vector<std::vector<std::int32_t>> usemtl(threads);
+
+    for (std::size_t i = 0; i < threads; i++) {
+        position_base[i + 1] = position_base[i] + chunks[i].positions.size();
+        normal_base[i + 1] = normal_base[i] + chunks[i].normals.size();
+        face_base[i + 1] = face_base[i] + chunks[i].face_size.size();
+        corner_base[i + 1] = corner_base[i] + chunks[i].corner_vertex.size();
+
+        for (const auto &statement : chunks[i].usemtl) {
+            usemtl[i].push_back(material_id(statement.second));
+        }
+
+        first_material[i + 1] = usemtl[i].empty() ? first_material[i] : usemtl[i].back();
+    }
+
+    mesh.positions.resize(position_base[threads]);
+    mesh.normals.resize(normal_base[threads]);
+    mesh.face_first.resize(face_base[threads] + 1);
+    mesh.face_material.resize(face_base[threads]);
+    mesh.corner_vertex.resize(corner_base[threads]);
+    mesh.corner_normal.resize(corner_base[threads]);
+    mesh.face_first.back() = (std::uint32_t) corner_base[threads];
+
+    std::vector<char> valid(threads, 0);
+    auto merge = [&](std::size_t i) {
+        valid[i] = merge_chunk(chunks[i], mesh, position_base[i], normal_base[i],
+                               face_base[i], corner_base[i], first_material[i], usemtl[i]);
+    };
+
+    workers.clear();
+    for (std::size_t i = 1; i < threads; i++) {
+        workers.emplace_back(merge, i);
+    }
+
+    merge(0);
+
+    for (auto &worker : workers) {
+        worker.join();
+    }
+
+    if (std::find(valid.begin(), valid.end(), 0) != valid.end()) {
+        err += "Face index out of range in " + path + "\n";
+        return false;
+    }
+
+    /* Every 'o' or 'g' line starts a new shape */
+    mesh.shape_first.push_back(0);
+    for (std::size_t i = 0; i < threads; i++) {
+        for (auto f : chunks[i].shapes) {
+            mesh.shape_first.push_back((std::uint32_t) (face_base[i] + f));
+        }
+    }
+
+    mesh.shape_first.erase(std::unique(mesh.shape_first.begin(), mesh.shape_first.end()),
+                           mesh.shape_first.end());
+
+    return true;
+}
@@ -0,0 +1,303 @@
+#include "../includes/pack.h"
+#include "../includes/utils.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+inline std::uint64_t align(std::uint64_t offset) {
+    return (offset + PACK_ALIGN - 1) / PACK_ALIGN * PACK_ALIGN;
+}
+
+bool is_pack(const std::string &path) {
+    return path.size() >= PACK_EXTENSION.size() &&
+           path.compare(path.size() - PACK_EXTENSION.size(), PACK_EXTENSION.size(), PACK_EXTENSION) == 0;
+}
+
+struct pack_contents {
+    std::vector<pack_section> sections;
+    std::vector<const void *> data;
+};
+
+template<typename T>
+void add_section(pack_contents &contents, PACK_SECTION type, std::uint32_t mesh, const T *data, std::size_t count) {
+    pack_section s = {};
+    s.type = type;
+    s.mesh = mesh;
+    s.bytes = count * sizeof(T);
+
+    contents.sections.push_back(s);
+    contents.data.push_back(data);
+}
+
+template<typename T>
+void add_section(pack_contents &contents, PACK_SECTION type, std::uint32_t mesh, const std::vector<T> &v) {
+    add_section(contents, type, mesh, v.data(), v.size());
+}
+
+bool save_pack(const std::string &path, const scene &sc, const std::vector<instance> &instances,
+               const scene_bvh *world, const stats &stat) {
+    pack_contents contents;
+
+    add_section(contents, PACK_VERTICES, 0, sc.vertices);
+    add_section(contents, PACK_INDICES, 0, sc.indices);
+    add_section(contents, PACK_VERTEX_PATCH, 0, sc.vertex_patch);
+    add_section(contents, PACK_NORMALS, 0, sc.normal);
+    add_section(contents, PACK_AREA, 0, sc.area);
+    add_section(contents, PACK_SPLIT, 0, sc.split);
+    add_section(contents, PACK_MATERIAL, 0, sc.material);
+    add_section(contents, PACK_INSTANCES, 0, instances);
+
+    std::vector<char> names;
+    for (const auto &name : sc.material_name) {
+        names.insert(names.end(), name.begin(), name.end());
+        names.push_back('\0');
+    }
+
+    add_section(contents, PACK_MATERIAL_NAMES, 0, names);
+
+    /* Wavelengths are separate vectors in memory, one section each keeps them contiguous in the file */
+    for (int wave_len = 0; wave_len < 3; wave_len++) {
+        add_section(contents, PACK_COLOR, (std::uint32_t) wave_len, sc.color[wave_len]);
+        add_section(contents, PACK_EMIT, (std::uint32_t) wave_len, sc.emit[wave_len]);
+    }
+
+    if (world != nullptr) {
+        for (std::size_t m = 0; m < world->meshes.size(); m++) {
+            const mesh_bvh &mesh = world->meshes[m];
+            add_section(contents, PACK_MESH_VERTICES, (std::uint32_t) m, mesh.vertices);
+            add_section(contents, PACK_MESH_NORMALS, (std::uint32_t) m, mesh.normals);
+            add_section(contents, PACK_MESH_PRIMITIVES, (std::uint32_t) m, mesh.primitives);
+            add_section(contents, PACK_MESH_NODES, (std::uint32_t) m, mesh.nodes);
+        }
+
+        add_section(contents, PACK_WORLD_INSTANCES, 0, world->instances);
+        add_section(contents, PACK_WORLD_ORDER, 0, world->ordered_instances);
+        add_section(contents, PACK_WORLD_NODES, 0, world->nodes);
+    }
+
+    pack_header header = {};
+    std::memcpy(header.magic, PACK_MAGIC, sizeof(PACK_MAGIC));
+    header.version = PACK_VERSION;
+    header.sections = (std::uint32_t) contents.sections.size();
+    header.has_bvh = world != nullptr;
+    header.meshes = (world != nullptr) ? (std::uint32_t) world->meshes.size() : 0;
+    header.instance_size = sizeof(instance);
+    header.node_size = sizeof(linear_node);
+    header.size = sc.size;
+    header.light_sources_count = (std::uint32_t) stat.light_sources_count;
+    header.instances_count = (std::uint32_t) stat.instances_count;
+    header.meshes_count = (std::uint32_t) stat.meshes_count;
+
+    std::uint64_t offset = sizeof(pack_header) + contents.sections.size() * sizeof(pack_section);
+    for (auto &s : contents.sections) {
+        s.offset = align(offset);
+        offset = s.offset + s.bytes;
+    }
+
+    std::ofstream file(path.c_str(), std::ios::out | std::ios::binary);
+    if (!file) {
+        std::cerr << "Cannot write " << path << std::endl;
+        return false;
+    }
+
+    file.write((const char *) &header, sizeof(header));
+    file.write((const char *) contents.sections.data(), contents.sections.size() * sizeof(pack_section));
+
+    const char padding[PACK_ALIGN] = {};
+    offset = sizeof(pack_header) + contents.sections.size() * sizeof(pack_section);
+
+    for (std::size_t i = 0; i < contents.sections.size(); i++) {
+        const pack_section &s = contents.sections[i];
+        file.write(padding, s.offset - offset);
+        file.write((const char *) contents.data[i], s.bytes);
+        offset = s.offset + s.bytes;
+    }
+
+    return (bool) file;
+}
+
+/* Bytes of one item of a section, unknown sections are read as bytes and skipped */
+std::uint64_t element_size(std::uint32_t type) {
+    switch (type) {
+        case PACK_VERTICES: return sizeof(glm::vec3);
+        case PACK_INDICES: return sizeof(std::uint32_t);
+        case PACK_VERTEX_PATCH: return sizeof(std::uint32_t);
+        case PACK_NORMALS: return sizeof(glm::vec3);
+        case PACK_AREA: return sizeof(float);
+        case PACK_SPLIT: return sizeof(float);
+        case PACK_MATERIAL: return sizeof(std::uint16_t);
+        case PACK_COLOR: return sizeof(float);
+        case PACK_EMIT: return sizeof(float);
+        case PACK_INSTANCES: return sizeof(instance);
+        case PACK_MESH_VERTICES: return sizeof(glm::vec3);
+        case PACK_MESH_NORMALS: return sizeof(glm::vec3);
+        case PACK_MESH_PRIMITIVES: return sizeof(std::uint32_t);
+        case PACK_MESH_NODES: return sizeof(linear_node);
+        case PACK_WORLD_INSTANCES: return sizeof(instance);
+        case PACK_WORLD_ORDER: return sizeof(std::size_t);
+        case PACK_WORLD_NODES: return sizeof(linear_node);
+        default: return 1;
+    }
+}
+
+/* Every id must name an item the scene has, the solver indexes with them unchecked */
+template<typename T>
+bool ids_in_range(const std::vector<T> &ids, std::size_t count) {
+    for (auto id : ids) {
+        if (id >= count) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Per patch, per vertex and per material arrays must agree with each other and the header */
+bool scene_consistent(const scene &sc, std::uint32_t size) {
+    std::size_t materials = sc.color[0].size();
+
+    for (int wave_len = 0; wave_len < 3; wave_len++) {
+        if (sc.color[wave_len].size() != materials || sc.emit[wave_len].size() != materials) {
+            return false;
+        }
+    }
+
+    return sc.normal.size() == size && sc.area.size() == size && sc.split.size() == size &&
+           sc.material.size() == size && sc.indices.size() == (std::size_t) MAX_CORNERS * size &&
+           sc.vertex_patch.size() == sc.vertices.size() &&
+           ids_in_range(sc.indices, sc.vertices.size()) &&
+           ids_in_range(sc.vertex_patch, size) &&
+           ids_in_range(sc.material, materials);
+}
+
+template<typename T>
+void read_section(const char *data, const pack_section &s, std::vector<T> &v) {
+    v.resize(s.bytes / sizeof(T));
+    std::memcpy((void *) v.data(), data + s.offset, v.size() * sizeof(T));
+}
+
+bool load_pack(const std::string &path, scene &sc, std::vector<instance> &instances,
+               scene_bvh &world, bool &has_bvh, stats &stat) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Cannot open " << path << std::endl;
+        return false;
+    }
+
+    struct stat info = {};
+    if (fstat(fd, &info) != 0) {
+        std::cerr << "Cannot stat " << path << std::endl;
+        close(fd);
+        return false;
+    }
+    auto size = (std::size_t) info.st_size;
+
+    void *mapped = (size >= sizeof(pack_header)) ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+
+    if (mapped == MAP_FAILED) {
+        std::cerr << "Cannot map " << path << std::endl;
+        return false;
+    }
+
+    auto data = (const char *) mapped;
+    auto header = (const pack_header *) data;
+    auto sections = (const pack_section *) (data + sizeof(pack_header));
+
+    bool valid = std::memcmp(header->magic, PACK_MAGIC, sizeof(PACK_MAGIC)) == 0 &&
+                 header->version == PACK_VERSION &&
+                 header->instance_size == sizeof(instance) &&
+                 header->node_size == sizeof(linear_node) &&
+                 sizeof(pack_header) + header->sections * sizeof(pack_section) <= size;
+
+    for (std::uint32_t i = 0; valid && i < header->sections; i++) {
+        const pack_section &s = sections[i];
+        std::uint32_t meshes = (s.type == PACK_COLOR || s.type == PACK_EMIT) ? 3 : std::max(header->meshes, 1u);
+
+        /* Compared without overflowing offset + bytes */
+        valid = s.offset % PACK_ALIGN == 0 && s.offset <= size && s.bytes <= size - s.offset &&
+                s.bytes % element_size(s.type) == 0 && s.mesh < meshes;
+    }
+
+    if (!valid) {
+        std::cerr << path << " is not a version " << PACK_VERSION << " scene for this build, rerun rad-pack"
+                  << std::endl;
+        munmap(mapped, size);
+        return false;
+    }
+
+    sc = {};
+    world = {};
+    world.meshes.resize(header->meshes);
+    has_bvh = header->has_bvh != 0;
+
+    for (std::uint32_t i = 0; i < header->sections; i++) {
+        const pack_section &s = sections[i];
+
+        switch (s.type) {
+            case PACK_VERTICES: read_section(data, s, sc.vertices); break;
+            case PACK_INDICES: read_section(data, s, sc.indices); break;
+            case PACK_VERTEX_PATCH: read_section(data, s, sc.vertex_patch); break;
+            case PACK_NORMALS: read_section(data, s, sc.normal); break;
+            case PACK_AREA: read_section(data, s, sc.area); break;
+            case PACK_SPLIT: read_section(data, s, sc.split); break;
+            case PACK_MATERIAL: read_section(data, s, sc.material); break;
+            case PACK_MATERIAL_NAMES: {
+                const char *name = data + s.offset;
+                const char *last = name + s.bytes;
+
+                while (name < last) {
+                    std::size_t len = strnlen(name, last - name);
+                    sc.material_name.emplace_back(name, len);
+                    name += len + 1;
+                }
+                break;
+            }
+            case PACK_COLOR: read_section(data, s, sc.color[s.mesh]); break;
+            case PACK_EMIT: read_section(data, s, sc.emit[s.mesh]); break;
+            case PACK_INSTANCES: read_section(data, s, instances); break;
+            case PACK_MESH_VERTICES: read_section(data, s, world.meshes[s.mesh].vertices); break;
+            case PACK_MESH_NORMALS: read_section(data, s, world.meshes[s.mesh].normals); break;
+            case PACK_MESH_PRIMITIVES: read_section(data, s, world.meshes[s.mesh].primitives); break;
+            case PACK_MESH_NODES: read_section(data, s, world.meshes[s.mesh].nodes); break;
+            case PACK_WORLD_INSTANCES: read_section(data, s, world.instances); break;
+            case PACK_WORLD_ORDER: read_section(data, s, world.ordered_instances); break;
+            case PACK_WORLD_NODES: read_section(data, s, world.nodes); break;
+            default: break;
+        }
+    }
+
+    std::uint32_t header_size = header->size;
+    sc.size = header->size;
+    stat.polygons_count = header->size;
+    stat.light_sources_count = header->light_sources_count;
+    stat.instances_count = header->instances_count;
+    stat.meshes_count = header->meshes_count;
+
+    munmap(mapped, size);
+
+    if (!scene_consistent(sc, header_size)) {
+        std::cerr << path << " has sections that do not match its " << header_size << " patches, rerun rad-pack"
+                  << std::endl;
+        return false;
+    }
+
+    /* Solver state and output */
+    for (int wave_len = 0; wave_len < 3; wave_len++) {
+        sc.p_total[wave_len].assign(sc.size, 0.0f);
+        sc.p_unshot[wave_len].assign(sc.size, 0.0f);
+        sc.p_recieved[wave_len].assign(sc.size, 0.0f);
+    }
+
+    sc.colors.assign(sc.vertices.size(), glm::vec3(0.0f));
+    find_emitters(sc);
+
+    return true;
+}
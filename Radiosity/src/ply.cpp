@@ -0,0 +1,359 @@
+#include "../includes/ply.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <sstream>
+
+enum ply_type {
+    PLY_NONE,
+    PLY_INT8,
+    PLY_UINT8,
+    PLY_INT16,
+    PLY_UINT16,
+    PLY_INT32,
+    PLY_UINT32,
+    PLY_FLOAT32,
+    PLY_FLOAT64,
+};
+
+/* What a property is used for, so names are compared once per file and not per vertex */
+enum ply_role {
+    PLY_SKIP,
+    PLY_X,
+    PLY_Y,
+    PLY_Z,
+    PLY_NX,
+    PLY_NY,
+    PLY_NZ,
+    PLY_INDICES,
+    PLY_MATERIAL,
+};
+
+struct ply_property {
+    std::string name;
+    ply_type type;
+    ply_type count_type; // PLY_NONE unless the property is a list
+    ply_role role;
+};
+
+struct ply_element {
+    std::string name;
+    std::size_t count;
+    std::vector<ply_property> properties;
+};
+
+ply_type parse_type(const std::string &name) {
+    if (name == "char" || name == "int8") { return PLY_INT8; }
+    if (name == "uchar" || name == "uint8") { return PLY_UINT8; }
+    if (name == "short" || name == "int16") { return PLY_INT16; }
+    if (name == "ushort" || name == "uint16") { return PLY_UINT16; }
+    if (name == "int" || name == "int32") { return PLY_INT32; }
+    if (name == "uint" || name == "uint32") { return PLY_UINT32; }
+    if (name == "float" || name == "float32") { return PLY_FLOAT32; }
+    if (name == "double" || name == "float64") { return PLY_FLOAT64; }
+    return PLY_NONE;
+}
+
+ply_role property_role(const std::string &element, const ply_property &p) {
+    bool list = p.count_type != PLY_NONE;
+
+    if (element == "vertex" && !list) {
+        if (p.name == "x") { return PLY_X; }
+        if (p.name == "y") { return PLY_Y; }
+        if (p.name == "z") { return PLY_Z; }
+        if (p.name == "nx") { return PLY_NX; }
+        if (p.name == "ny") { return PLY_NY; }
+        if (p.name == "nz") { return PLY_NZ; }
+    } else if (element == "face") {
+        if (list && (p.name == "vertex_indices" || p.name == "vertex_index")) { return PLY_INDICES; }
+        if (!list && p.name == "material_index") { return PLY_MATERIAL; }
+    }
+
+    return PLY_SKIP;
+}
+
+std::size_t type_size(ply_type t) {
+    static const std::size_t SIZES[] = {0, 1, 1, 2, 2, 4, 4, 4, 8};
+    return SIZES[t];
+}
+
+/* The file is little-endian like every host we run on, values are copied as they are */
+inline double read_value(const char *p, ply_type t) {
+    switch (t) {
+        case PLY_INT8: { std::int8_t v; std::memcpy(&v, p, 1); return v; }
+        case PLY_UINT8: { std::uint8_t v; std::memcpy(&v, p, 1); return v; }
+        case PLY_INT16: { std::int16_t v; std::memcpy(&v, p, 2); return v; }
+        case PLY_UINT16: { std::uint16_t v; std::memcpy(&v, p, 2); return v; }
+        case PLY_INT32: { std::int32_t v; std::memcpy(&v, p, 4); return v; }
+        case PLY_UINT32: { std::uint32_t v; std::memcpy(&v, p, 4); return v; }
+        case PLY_FLOAT32: { float v; std::memcpy(&v, p, 4); return v; }
+        case PLY_FLOAT64: { double v; std::memcpy(&v, p, 8); return v; }
+        default: return 0.0;
+    }
+}
+
+/* Counts, indices and material ids must be whole numbers in the int32 range, a file that
+ * stores anything else there is malformed */
+inline bool read_int(const char *p, ply_type t, std::int32_t &value) {
+    double v = read_value(p, t);
+
+    if (!(v >= std::numeric_limits<std::int32_t>::min() && v <= std::numeric_limits<std::int32_t>::max()) ||
+        v != std::trunc(v)) {
+        return false;
+    }
+
+    value = (std::int32_t) v;
+    return true;
+}
+
+/* Reads the text header up to end_header, returns the offset of the binary body or 0 */
+std::size_t parse_header(const char *data, std::size_t size, std::vector<ply_element> &elements, std::string &err) {
+    const char END[] = "end_header";
+    const char *end = data + size;
+    const char *s = data;
+    bool binary = false;
+
+    if (size < 4 || std::memcmp(data, "ply", 3) != 0) {
+        err = "Not a PLY file";
+        return 0;
+    }
+
+    while (s < end) {
+        auto eol = (const char *) std::memchr(s, '\n', end - s);
+        if (eol == nullptr) { break; }
+
+        std::istringstream line(std::string(s, eol));
+        std::string key;
+        line >> key;
+        s = eol + 1;
+
+        if (key == "format") {
+            std::string format;
+            line >> format;
+            binary = format == "binary_little_endian";
+        } else if (key == "element") {
+            ply_element e = {};
+            line >> e.name >> e.count;
+            elements.push_back(e);
+        } else if (key == "property" && !elements.empty()) {
+            ply_property p = {};
+            std::string type;
+            line >> type;
+
+            bool list = type == "list";
+            if (list) {
+                std::string count_type;
+                line >> count_type >> type;
+                p.count_type = parse_type(count_type);
+            }
+
+            line >> p.name;
+            p.type = parse_type(type);
+            p.role = property_role(elements.back().name, p);
+
+            if (p.type == PLY_NONE || (list && p.count_type == PLY_NONE)) {
+                err = "Unknown PLY property type " + type;
+                return 0;
+            }
+
+            elements.back().properties.push_back(p);
+        } else if (key == END) {
+            if (!binary) {
+                err = "Only binary_little_endian PLY files are supported";
+                return 0;
+            }
+
+            return (std::size_t) (s - data);
+        }
+    }
+
+    err = "PLY header is not terminated";
+    return 0;
+}
+
+bool load_ply(const std::string &path, obj_mesh &mesh, std::string &err) {
+    mesh = {};
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        err = "Cannot open " + path;
+        return false;
+    }
+
+    struct stat info = {};
+    fstat(fd, &info);
+    auto size = (std::size_t) info.st_size;
+
+    void *mapped = (size > 0) ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+
+    if (mapped == MAP_FAILED) {
+        err = "Cannot map " + path;
+        return false;
+    }
+
+    madvise(mapped, size, MADV_SEQUENTIAL);
+
+    auto data = (const char *) mapped;
+    const char *end = data + size;
+    std::vector<ply_element> elements;
+    std::size_t body = parse_header(data, size, elements, err);
+    const char *p = data + body;
+    bool valid = body != 0;
+
+    for (const auto &element : elements) {
+        if (!valid) { break; }
+
+        bool vertices = element.name == "vertex";
+        bool faces = element.name == "face";
+        bool normals = false;
+
+        for (const auto &property : element.properties) {
+            normals |= property.role == PLY_NX;
+        }
+
+        if (vertices) {
+            mesh.positions.reserve(element.count);
+        }
+
+        if (faces) {
+            mesh.face_first.reserve(element.count + 1);
+            mesh.face_material.reserve(element.count);
+            mesh.corner_vertex.reserve(3 * element.count);
+            mesh.corner_normal.reserve(3 * element.count);
+        }
+
+        for (std::size_t i = 0; valid && i < element.count; i++) {
+            glm::vec3 position(0.0f), normal(0.0f);
+            std::int32_t material = 0;
+
+            if (faces) {
+                mesh.face_first.push_back((std::uint32_t) mesh.corner_vertex.size());
+            }
+
+            for (const auto &property : element.properties) {
+                std::size_t count = 1;
+
+                if (property.count_type != PLY_NONE) {
+                    if (p + type_size(property.count_type) > end) {
+                        valid = false;
+                        break;
+                    }
+
+                    std::int32_t list_count;
+                    if (!read_int(p, property.count_type, list_count) || list_count < 0) {
+                        err = "Malformed list length in " + path;
+                        valid = false;
+                        break;
+                    }
+
+                    count = (std::size_t) list_count;
+                    p += type_size(property.count_type);
+                }
+
+                std::size_t bytes = count * type_size(property.type);
+                if (p + bytes > end) {
+                    valid = false;
+                    break;
+                }
+
+                switch (property.role) {
+                    case PLY_X: position.x = (float) read_value(p, property.type); break;
+                    case PLY_Y: position.y = (float) read_value(p, property.type); break;
+                    case PLY_Z: position.z = (float) read_value(p, property.type); break;
+                    case PLY_NX: normal.x = (float) read_value(p, property.type); break;
+                    case PLY_NY: normal.y = (float) read_value(p, property.type); break;
+                    case PLY_NZ: normal.z = (float) read_value(p, property.type); break;
+                    case PLY_INDICES:
+                        for (std::size_t c = 0; c < count; c++) {
+                            std::int32_t index;
+                            if (!read_int(p + c * type_size(property.type), property.type, index)) {
+                                valid = false;
+                                break;
+                            }
+
+                            mesh.corner_vertex.push_back(index);
+                            mesh.corner_normal.push_back(index);
+                        }
+                        break;
+                    case PLY_MATERIAL: valid = read_int(p, property.type, material); break;
+                    default: break;
+                }
+
+                if (!valid) {
+                    if (err.empty()) { err = "Malformed face in " + path; }
+                    break;
+                }
+
+                p += bytes;
+            }
+
+            if (vertices) {
+                mesh.positions.push_back(position);
+                if (normals) { mesh.normals.push_back(normal); }
+            }
+
+            if (faces) {
+                mesh.face_material.push_back(material);
+            }
+        }
+
+        if (!valid && err.empty()) {
+            err = "PLY file is truncated: " + path;
+        }
+    }
+
+    munmap(mapped, size);
+
+    if (!valid) {
+        return false;
+    }
+
+    /* Per-vertex normals share the vertex index, without them the corners have none */
+    bool has_normals = !mesh.normals.empty();
+    for (std::size_t c = 0; c < mesh.corner_vertex.size(); c++) {
+        std::int32_t index = mesh.corner_vertex[c];
+
+        if (index < 0 || index >= (std::int32_t) mesh.positions.size()) {
+            err = "Face index out of range in " + path;
+            return false;
+        }
+
+        if (!has_normals) {
+            mesh.corner_normal[c] = -1;
+        }
+    }
+
+    mesh.face_first.push_back((std::uint32_t) mesh.corner_vertex.size());
+    mesh.shape_first.push_back(0);
+
+    /* Materials from the sidecar MTL */
+    std::string sidecar = path.substr(0, path.find_last_of('.')) + ".mtl";
+
+    if (!load_mtl(sidecar, mesh.materials)) {
+        err += "WARN: Material file [ " + sidecar + " ] not found.\n";
+    }
+
+    /* Faces with no usable material share a white one that does not emit */
+    auto fallback = (std::int32_t) mesh.materials.size();
+    bool unassigned = false;
+
+    for (auto &material : mesh.face_material) {
+        if (material < 0 || material >= fallback) {
+            material = fallback;
+            unassigned = true;
+        }
+    }
+
+    if (unassigned) {
+        mesh.materials.push_back({PLY_DEFAULT_MATERIAL, glm::vec3(PLY_DEFAULT_DIFFUSE), glm::vec3(0.0f)});
+    }
+
+    return true;
+}
@@ -3,6 +3,8 @@
 #include <algorithm>
 
 #include "../includes/radiosity.h"
+#include "../includes/emitters.h"
+#include "../includes/sobol.h"
 #include "../includes/utils.h"
 
 std::random_device rd;
@@ -12,39 +14,64 @@ std::uniform_real_distribution<float> unilateral(0.0f, 1.0);
 const float PI = 3.1415926f;
 const std::string WAVES[] = {"RED", "GREEN", "BLUE"};
 
-float area(const patch &p) {
-    glm::vec3 a = p.vertices[0];
-    glm::vec3 b = p.vertices[1];
-    glm::vec3 c = p.vertices[2];
+float area(const glm::vec3 *vertices) {
+    return 0.5f * glm::length(glm::cross(vertices[1] - vertices[0], vertices[2] - vertices[0]));
+}
+
+/* Quads are split along the 0-2 diagonal, a triangle's second half is empty */
+float quad_area(const glm::vec3 *vertices) {
+    const glm::vec3 second[3] = {vertices[0], vertices[2], vertices[3]};
+    return area(vertices) + area(second);
+}
 
-    glm::vec3 ab = b - a;
-    glm::vec3 ac = c - a;
+/* Share of the quad's area in its 0-1-2 half, sample_quad() picks the half with it */
+float quad_split(const glm::vec3 *vertices) {
+    float total = quad_area(vertices);
+    return total > 0.0f ? area(vertices) / total : 1.0f;
+}
+
+glm::vec3 sample_point(const glm::vec3 *vertices) {
+    return sample_point(vertices, mt);
+}
 
-    float ab_len = glm::length(ab);
-    float ac_len = glm::length(ac);
+glm::vec3 sample_point(const glm::vec3 *vertices, std::mt19937 &gen) {
+    float r1 = unilateral(gen);
+    float r2 = unilateral(gen);
 
-    float denom = ab_len * ac_len;
-    if (denom < 1e-4) { return 0.0f; }
+    return sample_point(vertices, r1, r2);
+}
 
-    float cos = glm::dot(ab, ac) / (ab_len * ac_len);
-    if (glm::abs(cos - 1.0f) < 1e-4) { return 0.0f; }
+glm::vec3 sample_point(const glm::vec3 *vertices, float r1, float r2) {
+    return glm::vec3((1 - glm::sqrt(r1)) * vertices[0]
+                     + glm::sqrt(r1) * (1 - r2) * vertices[1]
+                     + r2 * glm::sqrt(r1) * vertices[2]);
+}
 
-    return 0.5f * ab_len * ac_len * glm::sqrt(1 - cos * cos);
+/* Uniform over the quad: pick a half by its share of the area, then a point in it */
+glm::vec3 sample_quad(const glm::vec3 *vertices, float split) {
+    return sample_quad(vertices, split, mt);
 }
 
-glm::vec3 sample_point(const patch *p) {
+glm::vec3 sample_quad(const glm::vec3 *vertices, float split, std::mt19937 &gen) {
+    float half = unilateral(gen);
+    float r1 = unilateral(gen);
+    float r2 = unilateral(gen);
+
+    return sample_quad(vertices, split, half, r1, r2);
+}
 
-    float r1 = unilateral(mt);
-    float r2 = unilateral(mt);
+glm::vec3 sample_quad(const glm::vec3 *vertices, float split, float half, float r1, float r2) {
+    if (half < split) {
+        return sample_point(vertices, r1, r2);
+    }
 
-    return glm::vec3((1 - glm::sqrt(r1)) * p->vertices[0]
-                     + glm::sqrt(r1) * (1 - r2) * p->vertices[1]
-                     + r2 * glm::sqrt(r1) * p->vertices[2]);
+    const glm::vec3 second[3] = {vertices[0], vertices[2], vertices[3]};
+    return sample_point(second, r1, r2);
 }
 
-float intersect(const ray &r, const patch &p, float ERR) {
-    glm::vec3 e1 = p.vertices[1] - p.vertices[0];
-    glm::vec3 e2 = p.vertices[2] - p.vertices[0];
+float intersect(const ray &r, const glm::vec3 *vertices, float ERR) {
+    glm::vec3 e1 = vertices[1] - vertices[0];
+    glm::vec3 e2 = vertices[2] - vertices[0];
 
     glm::vec3 pvec = glm::cross(r.direction, e2);
     float det = glm::dot(e1, pvec);
@@ -54,7 +81,7 @@ float intersect(const ray &r, const patch &p, float ERR) {
     }
 
     float inv_det = 1.0f / det;
-    glm::vec3 tvec = r.origin - p.vertices[0];
+    glm::vec3 tvec = r.origin - vertices[0];
     float u = glm::dot(tvec, pvec) * inv_det;
 
     if (u < 0.0f || u > 1.0f) {
@@ -71,30 +98,43 @@ float intersect(const ray &r, const patch &p, float ERR) {
     return glm::dot(e2, qvec) * inv_det;
 }
 
-bool visible(const glm::vec3 &a, const glm::vec3 &b, const patch *p_b,
-             const bvh_node *world, const std::vector<patch *> &primitives, float ERR) {
+/* Both halves of a planar quad lie in one plane, so a miss or a hit behind the
+ * origin in the first half is decided by the second */
+float intersect_quad(const ray &r, const glm::vec3 *vertices, float ERR) {
+    float t = intersect(r, vertices, ERR);
+
+    if (t >= 0.0f || vertices[3] == vertices[2]) {
+        return t;
+    }
+
+    const glm::vec3 second[3] = {vertices[0], vertices[2], vertices[3]};
+    return intersect(r, second, ERR);
+}
+
+bool visible(const glm::vec3 &a, const glm::vec3 &b, const scene &sc, std::uint32_t p_b,
+             const scene_bvh &world, float ERR) {
 
     ray r = {};
     r.origin = a;
     r.direction = glm::normalize(b - a);
 
-    float t_other_b = intersect(r, *p_b, ERR);
-    hit t_world = intersect(r, world, primitives, ERR);
+    float t_other_b = intersect_quad(r, corners(sc, p_b).vertices, ERR);
+    hit t_world = intersect(r, world, ERR);
 
     return !(t_world.hit && t_world.t > ERR && t_world.t < t_other_b);
 }
 
 float p2p_form_factor(const glm::vec3 &a, const glm::vec3 &n_a,
-                      const glm::vec3 &b, const patch *p_b, float ERR, int FF_SAMPLES) {
+                      const glm::vec3 &b, const glm::vec3 &n_b, float area_b, float ERR, int FF_SAMPLES) {
     float r = glm::length(b - a);
-    float denom = PI * r * r + p_b->area / FF_SAMPLES;
+    float denom = PI * r * r + area_b / FF_SAMPLES;
     if (denom < ERR) { return 0.0f; }
 
     glm::vec3 ab = glm::normalize(b - a);
 
     float cos_xy_na = glm::dot(ab, n_a);
     if (cos_xy_na <= ERR) { return 0.0f; }
-    float cos_xy_nb = glm::dot(-1.0f * ab, p_b->normal);
+    float cos_xy_nb = glm::dot(-1.0f * ab, n_b);
     if (cos_xy_nb <= ERR) { return 0.0f; }
 
     float nom = cos_xy_na * cos_xy_nb; // normals are expected to be normalized!
@@ -102,90 +142,269 @@ float p2p_form_factor(const glm::vec3 &a, const glm::vec3 &n_a,
     return nom / denom;
 }
 
-float form_factor(const patch *here, const patch *there,
-                  const bvh_node *world, const std::vector<patch *> &primitives,
-                  float ERR, int FF_SAMPLES) {
+float form_factor(const scene &sc, std::uint32_t here, std::uint32_t there,
+                  const scene_bvh &world, float ERR, int FF_SAMPLES) {
     // from 'Radiosity and Realistic Image Synthesis' p. 95
     float F_ij = 0.0f;
 
     for (int k = 0; k < FF_SAMPLES; k++) {
-        glm::vec3 here_p = sample_point(here);
-        glm::vec3 there_p = sample_point(there);
+        glm::vec3 here_p = sample_quad(corners(sc, here).vertices, sc.split[here]);
+        glm::vec3 there_p = sample_quad(corners(sc, there).vertices, sc.split[there]);
 
-        if (visible(here_p, there_p, there, world, primitives, ERR)) {
-            float dF = p2p_form_factor(here_p, here->normal, there_p, there, ERR, FF_SAMPLES);
+        if (visible(here_p, there_p, sc, there, world, ERR)) {
+            float dF = p2p_form_factor(here_p, sc.normal[here], there_p, sc.normal[there],
+                                       sc.area[there], ERR, FF_SAMPLES);
             if (dF > 0.0f) {
                 F_ij += dF;
             }
         }
     }
 
-    F_ij *= there->area; // there?
+    F_ij *= sc.area[there]; // there?
 
     return F_ij;
 }
 
-void iteration(const bvh_node *world, const std::vector<patch *> &primitives,
-               float ERR, int FF_SAMPLES) {
+glm::vec3 log_average(const std::vector<float> &colors, TONEMAP_MODE mode) {
+    std::size_t count = colors.size() / 3;
+
+    /* Per thread sums, luminance in the fourth slot */
+    struct log_sum {
+        double logs[4];
+        std::size_t n[4];
+    };
 
-    for (auto p : primitives) {
-        glm::vec3 rad_new = glm::vec3(0.0f);
+    std::vector<log_sum> sums(parallel_threads(count, PARALLEL_MIN_CHUNK), log_sum{});
 
-        for (auto p_other: primitives) {
-            float ff = form_factor(p, p_other, world, primitives, ERR, FF_SAMPLES);
-            rad_new += p_other->rad * ff;
+    /* Only the slots the mode reads are summed, luminance takes one log per color */
+    int first = (mode == TONEMAP_LUMINANCE) ? 3 : 0;
+    int last = (mode == TONEMAP_LUMINANCE) ? 4 : 3;
+
+    parallel_ranges(count, PARALLEL_MIN_CHUNK, [&](std::size_t from, std::size_t to, std::size_t thread) {
+        double logs[4] = {0.0, 0.0, 0.0, 0.0};
+        std::size_t n[4] = {0, 0, 0, 0};
+
+        for (std::size_t i = from; i < to; i++) {
+            const float *c = &colors[i * 3];
+            float value[4] = {c[0], c[1], c[2], LUMINANCE.r * c[0] + LUMINANCE.g * c[1] + LUMINANCE.b * c[2]};
+
+            for (int k = first; k < last; k++) {
+                bool lit = value[k] > MIN_LUMINANCE;
+                logs[k] += lit ? std::log(value[k]) : 0.0f;
+                n[k] += lit;
+            }
         }
 
-        rad_new *= p->color;
-        rad_new += p->emit;
+        for (int k = 0; k < 4; k++) {
+            sums[thread].logs[k] = logs[k];
+            sums[thread].n[k] = n[k];
+        }
+    });
 
-        p->rad_new = rad_new;
-    }
+    double logs[4] = {0.0, 0.0, 0.0, 0.0};
+    std::size_t n[4] = {0, 0, 0, 0};
 
+    for (const auto &sum : sums) {
+        for (int k = 0; k < 4; k++) {
+            logs[k] += sum.logs[k];
+            n[k] += sum.n[k];
+        }
+    }
 
-    for (auto p : primitives) {
-        p->rad = p->rad_new;
+    glm::vec3 L_avg;
+    for (int wave_len = 0; wave_len < 3; wave_len++) {
+        int k = (mode == TONEMAP_LUMINANCE) ? 3 : wave_len;
+        L_avg[wave_len] = (n[k] > 0) ? (float) std::exp(logs[k] / (double) n[k]) : 1.0f;
     }
+
+    return L_avg;
 }
 
-void reinhard(std::vector<float> &vertices) {
-    std::size_t vert_count = vertices.size() / 6; // 3 coords + 3 colors
+/* Reinhard's operator, with the white point extension when white is finite */
+inline float reinhard(float L, float white) {
+    return L * (1.0f + L / (white * white)) / (1.0f + L);
+}
 
-    double log_space_sum[3] = {0.0, 0.0, 0.0};
-    double MIN_COLOR = 1e-3;
-    double inv_n = 1.0 / (double) vert_count;
+void reinhard(const float *hdr, float *ldr, std::size_t count, const tonemap_params &tm) {
+    glm::vec3 scale = tm.key / tm.log_average;
 
-    for (int wave_len = 0; wave_len < 3; ++wave_len) {
-        for (std::size_t i = 0; i < vert_count; ++i) {
-            if (vertices[i * 6 + 3 + wave_len] > MIN_COLOR) {
-                auto old = log_space_sum[wave_len];
-                log_space_sum[wave_len] += inv_n * glm::log(vertices[i * 6 + 3 + wave_len]);
-                if (log_space_sum[wave_len] == INF) {
-                    std::cout << old << " + " << vertices[i * 6 + 3 + wave_len] << std::endl;
-                    break;
-                }
+    parallel_ranges(count, PARALLEL_MIN_CHUNK, [&](std::size_t from, std::size_t to, std::size_t) {
+        for (std::size_t i = from; i < to; i++) {
+            const float *c = &hdr[i * 3];
+            float *out = &ldr[i * 3];
+
+            if (tm.mode == TONEMAP_LUMINANCE) {
+                float L = LUMINANCE.r * c[0] + LUMINANCE.g * c[1] + LUMINANCE.b * c[2];
+                float Ls = scale.r * L;
+                float ratio = (L > 0.0f) ? reinhard(Ls, tm.white) / L : 0.0f;
+
+                out[0] = c[0] * ratio;
+                out[1] = c[1] * ratio;
+                out[2] = c[2] * ratio;
+            } else {
+                out[0] = reinhard(scale.r * c[0], tm.white);
+                out[1] = reinhard(scale.g * c[1], tm.white);
+                out[2] = reinhard(scale.b * c[2], tm.white);
             }
         }
+    });
+}
+
+void histogram_curve(const std::vector<float> &colors, float *curve) {
+    const int CEILING_PASSES = 64;
+    const float bin_width = (HISTOGRAM_LOG_MAX - HISTOGRAM_LOG_MIN) / HISTOGRAM_BINS;
+    const float log_display = std::log(HISTOGRAM_DISPLAY_RANGE);
+
+    std::size_t count = colors.size() / 3;
+    std::vector<std::vector<std::size_t>> bins(parallel_threads(count, PARALLEL_MIN_CHUNK),
+                                               std::vector<std::size_t>(HISTOGRAM_BINS, 0));
+
+    parallel_ranges(count, PARALLEL_MIN_CHUNK, [&](std::size_t from, std::size_t to, std::size_t thread) {
+        std::vector<std::size_t> &local = bins[thread];
+
+        for (std::size_t i = from; i < to; i++) {
+            const float *c = &colors[i * 3];
+            float L = LUMINANCE.r * c[0] + LUMINANCE.g * c[1] + LUMINANCE.b * c[2];
+
+            if (L > MIN_LUMINANCE) {
+                int bin = (int) ((std::log(L) - HISTOGRAM_LOG_MIN) / bin_width);
+                local[std::min(bin, HISTOGRAM_BINS - 1)]++;
+            }
+        }
+    });
+
+    double counts[HISTOGRAM_BINS] = {};
+    int first = HISTOGRAM_BINS, last = -1;
+
+    for (int b = 0; b < HISTOGRAM_BINS; b++) {
+        for (const auto &local : bins) {
+            counts[b] += local[b];
+        }
+
+        if (counts[b] > 0.0) {
+            first = std::min(first, b);
+            last = b;
+        }
     }
 
-    double L_avg[3];
-    for (int wave_len = 0; wave_len < 3; ++wave_len) {
-        std::cout << log_space_sum[wave_len] << std::endl;
-        L_avg[wave_len] = glm::exp(log_space_sum[wave_len]);
-        std::cout << L_avg[wave_len] << std::endl;
+    if (last < 0) {
+        /* Nothing lit, straight line through the whole range */
+        for (int e = 0; e <= HISTOGRAM_BINS; e++) {
+            curve[e] = std::exp(HISTOGRAM_LOG_MIN + e * bin_width - HISTOGRAM_LOG_MAX);
+        }
+        return;
     }
 
-    double mid_gray(0.18); // 18% middle gray
+    if ((last + 1 - first) * bin_width <= log_display) {
+        /* The display holds the whole range, the brightest color maps to 1 */
+        float log_top = HISTOGRAM_LOG_MIN + (last + 1) * bin_width;
+        for (int e = 0; e <= HISTOGRAM_BINS; e++) {
+            curve[e] = std::min(std::exp(HISTOGRAM_LOG_MIN + e * bin_width - log_top), 1.0f);
+        }
+        return;
+    }
 
-    for (int wave_len = 0; wave_len < 3; ++wave_len) {
-        for (std::size_t i = 0; i < vert_count; ++i) {
-            vertices[i * 6 + 3 + wave_len] = (float) (mid_gray / L_avg[wave_len] * vertices[i * 6 + 3 + wave_len]);
-            vertices[i * 6 + 3 + wave_len] = vertices[i * 6 + 3 + wave_len] / (1.0f + vertices[i * 6 + 3 + wave_len]);
+    double total = 0.0;
+    for (double c : counts) {
+        total += c;
+    }
+
+    /* No bin may get more contrast than the world has, trim them to the linear ceiling */
+    const double counted = total;
+    bool converged = false;
+
+    for (int pass = 0; pass < CEILING_PASSES && !converged; pass++) {
+        double ceiling = total * bin_width / log_display;
+        double trimmed = 0.0;
+
+        for (double &c : counts) {
+            if (c > ceiling) {
+                trimmed += c - ceiling;
+                c = ceiling;
+            }
+        }
+
+        total -= trimmed;
+        converged = trimmed <= HISTOGRAM_TOLERANCE * total;
+
+        if (total < HISTOGRAM_TOLERANCE * counted) { break; }
+    }
+
+    if (!converged) {
+        /* The lit bins alone fit on the display, only the empty ones between them are squeezed */
+        total = 0.0;
+        for (double &c : counts) {
+            c = (c > 0.0) ? 1.0 : 0.0;
+            total += c;
+        }
+    }
+
+    /* Display log-luminance follows the cumulative distribution */
+    double cumulative = 0.0;
+    for (int e = 0; e <= HISTOGRAM_BINS; e++) {
+        curve[e] = std::exp(log_display * (float) (cumulative / total - 1.0));
+        if (e < HISTOGRAM_BINS) { cumulative += counts[e]; }
+    }
+
+    /* Empty bins below the darkest color continue linearly instead of showing it as gray */
+    for (int e = 0; e < first; e++) {
+        curve[e] = curve[first] * std::exp((e - first) * bin_width);
+    }
+}
+
+/* Display luminance of world luminance L, linear below the histogram */
+inline float histogram_lookup(const float *curve, float L) {
+    const float bin_width = (HISTOGRAM_LOG_MAX - HISTOGRAM_LOG_MIN) / HISTOGRAM_BINS;
+
+    float x = (std::log(L) - HISTOGRAM_LOG_MIN) / bin_width;
+    if (x < 0.0f) {
+        return curve[0] * L / std::exp(HISTOGRAM_LOG_MIN);
+    }
+
+    int e = std::min((int) x, HISTOGRAM_BINS - 1);
+    float t = std::min(x - e, 1.0f);
+
+    return curve[e] + t * (curve[e + 1] - curve[e]);
+}
+
+void histogram_adjust(const float *hdr, float *ldr, std::size_t count, const tonemap_params &tm) {
+    parallel_ranges(count, PARALLEL_MIN_CHUNK, [&](std::size_t from, std::size_t to, std::size_t) {
+        for (std::size_t i = from; i < to; i++) {
+            const float *c = &hdr[i * 3];
+            float *out = &ldr[i * 3];
+
+            float L = LUMINANCE.r * c[0] + LUMINANCE.g * c[1] + LUMINANCE.b * c[2];
+            float ratio = (L > 0.0f) ? histogram_lookup(tm.curve, L) / L : 0.0f;
+
+            out[0] = c[0] * ratio;
+            out[1] = c[1] * ratio;
+            out[2] = c[2] * ratio;
         }
+    });
+}
+
+void tonemap(const float *hdr, float *ldr, std::size_t count, const tonemap_params &tm) {
+    if (tm.op == TONEMAP_HISTOGRAM) {
+        histogram_adjust(hdr, ldr, count, tm);
+    } else {
+        reinhard(hdr, ldr, count, tm);
     }
 }
 
 glm::vec3 sample_hemi(const glm::vec3 &normal) {
+    return sample_hemi(normal, mt);
+}
+
+glm::vec3 sample_hemi(const glm::vec3 &normal, std::mt19937 &gen) {
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+
+    float u = uniform(gen);
+    float v = uniform(gen);
+
+    return sample_hemi(normal, u, v);
+}
+
+glm::vec3 sample_hemi(const glm::vec3 &normal, float u, float v) {
     glm::vec3 tan;
     if (glm::abs(glm::normalize(normal).y) > 0.999f) {
         tan = glm::vec3(1.0f, 0.0f, 0.0f);
@@ -195,9 +414,6 @@ glm::vec3 sample_hemi(const glm::vec3 &normal) {
 
     glm::vec3 bitan = glm::normalize(glm::cross(normal, tan));
 
-    float u = unilateral(mt);
-    float v = unilateral(mt);
-
     float cos_theta = glm::sqrt(1 - u);
     float sin_theta = glm::sqrt(1 - cos_theta * cos_theta);
     float phi = 2 * PI * v;
@@ -213,99 +429,199 @@ inline float sum(const glm::vec3 &v) {
     return v.x + v.y + v.z;
 }
 
-/* Transform per-patch constant radiosity to per-vertex values */
-void interpolate(std::vector<patch *> &primitives, bvh_node *world, int G_RAYS, int S_RAYS, float ERR) {
+inline glm::vec3 rgb(const std::vector<float> *channels, std::uint32_t i) {
+    return {channels[0][i], channels[1][i], channels[2][i]};
+}
 
-    /* For each disc. wavelength */
+/* Direct light from the emitters plus one bounce of the solution, seen from vertex v as a corner
+ * of patch p. Every ray is traced once for all three wavelengths */
+glm::vec3 gather(const scene &sc, const scene_bvh &world, const emitter_index &lights, std::uint32_t v,
+                 std::uint32_t p, int G_RAYS, int S_RAYS, float ERR, bool qmc, std::mt19937 &gen) {
+    glm::vec3 x = sc.vertices[v];
+    std::uint32_t seed = sobol_seed(p, v);
+    glm::vec3 color = rgb(sc.color, sc.material[p]);
+    glm::vec3 own = rgb(sc.p_total, p) / sc.area[p];
+
+    /* Wavelengths the patch emits in keep its own radiosity */
+    bool emitting[3];
+    bool all_emitting = true;
     for (int wave_len = 0; wave_len < 3; wave_len++) {
-        float nn = 1;
+        emitting[wave_len] = emittance(sc, wave_len, p) > ERR;
+        all_emitting = all_emitting && emitting[wave_len];
+    }
 
-        for (auto p : primitives) {
+    if (all_emitting) {
+        return own;
+    }
 
+    glm::vec3 result(0.0f);
 
-            if (p->emit[wave_len] > ERR) {
-                p->colors[0][wave_len] = p->colors[1][wave_len] = p->colors[2][wave_len] = p->p_total[wave_len];
-                continue;
+    /* Direct illumination */
+    for (int i = 0; i < S_RAYS && !lights.emitters.empty(); i++) {
+
+        float pdf;
+        std::uint32_t emitter = sample_emitter(lights, x, gen, pdf);
+        quad q = corners(sc, emitter);
+        glm::vec3 Ep = qmc ? sample_quad(q.vertices, sc.split[emitter], sobol(i, 0, seed), sobol(i, 1, seed), sobol(i, 2, seed))
+                           : sample_quad(q.vertices, sc.split[emitter], gen);
+
+        if (visible(x, Ep, sc, emitter, world, ERR)) {
+
+            glm::vec3 xy = Ep - x;
+            glm::vec3 xy_norm = glm::normalize(xy);
+
+            float r = glm::length(xy);
+            float G = 0.0f;
+
+            if (r > ERR) {
+                G = std::max(glm::dot(xy_norm, sc.normal[p]), 0.0f) *
+                    std::max(glm::dot(-xy_norm, sc.normal[emitter]), 0.0f) / (r * r);
             }
 
-            /* For each vertex in the scene*/
-            for (int v = 0; v < 3; v++) {
+            result += rgb(sc.p_total, emitter) * (G / pdf);
+        }
+    }
 
-                glm::vec3 x = p->vertices[v];
+    // (1 / N) * SUM_i^N   P_i / pdf_i * (color / PI) * G * V
+    if (S_RAYS > 0) {
+        result *= color / PI / (float) S_RAYS;
+    }
 
-                /* Separate light sources */
-                float P_total = 0.0f;
-                std::vector<patch *> emitters;
-                for (auto prim : primitives) {
-                    if (prim->emit[wave_len] > ERR) {
-                        emitters.push_back(prim);
-                        P_total += prim->p_total[wave_len];
-                    }
-                }
+    /* Indirect illumination, cosine weighted so the mean radiosity seen is the irradiance */
+    glm::vec3 B(0.0f);
 
-                /* Direct illumination */
-                if (emitters.empty()) {
-                    continue;
+    for (int i = 0; i < G_RAYS; i++) {
+        glm::vec3 direction = qmc ? sample_hemi(sc.normal[p], sobol(i, 3, seed), sobol(i, 4, seed))
+                                  : sample_hemi(sc.normal[p], gen);
+        ray sample = {x, direction};
+        hit nearest = intersect(sample, world, ERR);
+
+        if (nearest.hit && nearest.id != p) {
+            for (int wave_len = 0; wave_len < 3; wave_len++) {
+                if (emittance(sc, wave_len, nearest.id) < ERR) {
+                    B[wave_len] += sc.p_total[wave_len][nearest.id] / sc.area[nearest.id];
                 }
+            }
+        }
+    }
 
-                p->colors[v][wave_len] = 0.0f;
+    if (G_RAYS > 0) {
+        result += color * B / (float) G_RAYS;
+    }
 
-                for (int i = 0; i < S_RAYS / 3; i++) {
+    for (int wave_len = 0; wave_len < 3; wave_len++) {
+        if (emitting[wave_len]) {
+            result[wave_len] = own[wave_len];
+        }
+    }
 
-                    patch *emitter = emitters[(int) std::round((unilateral(mt) * (emitters.size() - 1)))];
-                    glm::vec3 Ep = sample_point(emitter);
+    return result;
+}
 
-                    if (visible(x, Ep, emitter, world, primitives, ERR)) {
+void print_progress(int percent_done) {
+    std::cout << "\rInterpolating... ";
+    if (percent_done >= 10) {
+        std::cout << percent_done;
+    } else {
+        std::cout << "0" << percent_done;
+    }
 
-                        glm::vec3 xy = Ep - p->vertices[v];
-                        glm::vec3 xy_norm = glm::normalize(xy);
+    std::cout << "%" << std::flush;
+}
 
-                        float r = glm::length(xy);
-                        float G = 0.0f;
+/* Transform per-patch constant radiosity to per-vertex values by a final gather, S_RAYS shadow
+ * and G_RAYS hemisphere rays per vertex. A shared vertex is gathered as a corner of each of its
+ * patches, with that patch's normal and material and its share of the rays, and the corners are
+ * averaged by area like vertex_radiosity() does. Blocks of vertices are handed out by parallel_items() */
+void interpolate(scene &sc, const scene_bvh &world, int G_RAYS, int S_RAYS, float ERR, bool qmc, bool verbose) {
+    std::size_t vertex_count = sc.vertices.size();
+    std::size_t blocks = (vertex_count + INTERPOLATE_BLOCK - 1) / INTERPOLATE_BLOCK;
+
+    /* Patches around each vertex, patches[first[v]] to patches[first[v + 1]] */
+    std::vector<std::uint32_t> first(vertex_count + 1, 0);
+    for (std::uint32_t p = 0; p < sc.size; p++) {
+        for (int c = 0; c < corners_count(sc, p); c++) {
+            first[sc.indices[MAX_CORNERS * p + c] + 1]++;
+        }
+    }
 
-                        if (r > ERR) {
-                            G = glm::dot(xy_norm, p->normal) * glm::dot(-xy_norm, emitter->normal) / (r * r);
-                        }
+    for (std::size_t v = 0; v < vertex_count; v++) {
+        first[v + 1] += first[v];
+    }
 
-                        p->colors[v][wave_len] += emitter->p_total[wave_len] * G;
-                    }
-                }
+    std::vector<std::uint32_t> patches(first[vertex_count]);
+    std::vector<std::uint32_t> filled(first.begin(), first.end() - 1);
+    for (std::uint32_t p = 0; p < sc.size; p++) {
+        for (int c = 0; c < corners_count(sc, p); c++) {
+            patches[filled[sc.indices[MAX_CORNERS * p + c]]++] = p;
+        }
+    }
 
+    /* Light sources are picked by their solved power, for every vertex */
+    emitter_index lights = build_emitter_index(sc);
 
-                // (N_L / N) * SUM_i^N   P_i * (color / PI) * G * V
-                p->colors[v][wave_len] *= (p->color[wave_len] / PI * emitters.size() / (S_RAYS / 3)) * 500.0f;
+    /* Wavelengths without a light source are left as they are */
+    bool lit[3] = {false, false, false};
+    for (auto prim : lights.emitters) {
+        for (int wave_len = 0; wave_len < 3; wave_len++) {
+            lit[wave_len] = lit[wave_len] || emittance(sc, wave_len, prim) > ERR;
+        }
+    }
 
+    if (!lit[0] && !lit[1] && !lit[2]) {
+        return;
+    }
 
-                /* Indirect illumination */
-                float B = 0.0f;
+    std::atomic<std::size_t> done(0);
+    int last_percent = -1; // only the calling thread writes the progress line
 
-                for (int i = 0; i < G_RAYS / 3; i++) {
-                    ray sample = {x, sample_hemi(p->normal)};
-                    hit nearest = intersect(sample, world, primitives, ERR);
+    parallel_items(blocks, [&](std::size_t block, std::size_t thread) {
+        /* Seeded by block, so the result does not depend on the thread count */
+        std::mt19937 gen((std::uint32_t) block);
 
-                    if (nearest.hit && nearest.p != p && nearest.p->emit[wave_len] < ERR) {
-                        B += nearest.p->p_total[wave_len];
-                    }
-                }
+        std::size_t from = block * INTERPOLATE_BLOCK;
+        std::size_t to = std::min(from + INTERPOLATE_BLOCK, vertex_count);
 
-                if (G_RAYS > 0) {
-                    p->colors[v][wave_len] += p->color[wave_len] * B / G_RAYS * 3;
-                }
+        for (std::size_t v = from; v < to; v++) {
+            auto count = (int) (first[v + 1] - first[v]);
+            if (count == 0) {
+                continue;
             }
 
+            int corner_g_rays = (G_RAYS + count - 1) / count;
+            int corner_s_rays = (S_RAYS + count - 1) / count;
+            glm::vec3 gathered(0.0f);
+            float gathered_area = 0.0f;
 
-            auto percent_done = (int) (100.0f * (nn++ / primitives.size()));
+            for (std::uint32_t i = first[v]; i < first[v + 1]; i++) {
+                std::uint32_t p = patches[i];
+                gathered += sc.area[p] * gather(sc, world, lights, (std::uint32_t) v, p, corner_g_rays, corner_s_rays,
+                                                ERR, qmc, gen);
+                gathered_area += sc.area[p];
+            }
 
-            std::cout << "\rInterpolating[" << WAVES[wave_len] << "]... ";
-            if (percent_done >= 10) {
-                std::cout << percent_done;
-            } else {
-                std::cout << "0" << percent_done;
+            if (gathered_area > 0.0f) {
+                gathered /= gathered_area;
             }
 
-            std::cout << "%" << std::flush;
+            for (int wave_len = 0; wave_len < 3; wave_len++) {
+                if (lit[wave_len]) {
+                    sc.colors[v][wave_len] = gathered[wave_len];
+                }
+            }
         }
 
+        std::size_t finished = done += to - from;
+        auto percent_done = (int) (100.0f * finished / vertex_count);
+
+        if (verbose && thread == 0 && percent_done != last_percent) {
+            last_percent = percent_done;
+            print_progress(percent_done);
+        }
+    });
+
+    if (verbose) {
+        print_progress(100);
         std::cout << std::endl;
     }
 
@@ -328,18 +644,100 @@ void interpolate(std::vector<patch *> &primitives, bvh_node *world, int G_RAYS,
       std::cout << "DONE" << std::endl;*/
 }
 
+/* Vertex radiosity is the area-weighted average of the patches around it */
+void vertex_radiosity(scene &sc) {
+    std::vector<float> vertex_area(sc.vertices.size(), 0.0f);
+    std::fill(sc.colors.begin(), sc.colors.end(), glm::vec3(0.0f));
+
+    for (std::uint32_t p = 0; p < sc.size; p++) {
+        glm::vec3 radiosity;
+
+        for (int wave_len = 0; wave_len < 3; wave_len++) {
+            radiosity[wave_len] = sc.p_total[wave_len][p] / sc.area[p];
+        }
+
+        for (int v = 0; v < corners_count(sc, p); v++) {
+            sc.colors[sc.indices[MAX_CORNERS * p + v]] += radiosity * sc.area[p];
+            vertex_area[sc.indices[MAX_CORNERS * p + v]] += sc.area[p];
+        }
+    }
+
+    for (std::size_t v = 0; v < sc.vertices.size(); v++) {
+        if (vertex_area[v] > 0.0f) {
+            sc.colors[v] /= vertex_area[v];
+        }
+    }
+}
+
+/* Stratified shooting of the unshot power of one wavelength into p_recieved */
+void shoot(scene &sc, int wave_len, long long N_samples, float total_unshot,
+           const scene_bvh &world, float ERR, bool qmc) {
+
+    const float *color = sc.color[wave_len].data();
+    const std::uint16_t *material = sc.material.data();
+    const float *p_unshot = sc.p_unshot[wave_len].data();
+    float *p_recieved = sc.p_recieved[wave_len].data();
+
+    /* Stratified sampling */
+    long long N_prev = 0;
+    float q = 0;
+    std::uint32_t pass = sc.pass++;
+    float xi = qmc ? sobol(pass, 0, 0) : unilateral(mt);
+
+    for (std::uint32_t p = 0; p < sc.size; p++) {
+        if (N_prev == N_samples) { break; }
+        auto q_i = p_unshot[p] / total_unshot;
+        q += q_i;
+        long N_i = (long) glm::floor(N_samples * q + xi) - N_prev;
+
+        /* Lift the origin off the patch, otherwise about half of the rays hit the patch itself */
+        float lift = 1e-4f * glm::sqrt(sc.area[p]);
+
+        /* The lines of one patch are the first N_i points of its own scrambled sequence */
+        std::uint32_t seed = sobol_seed(p, pass);
+
+        for (long i = 0; i < N_i; ++i) {
+            ray sample = {};
+            if (qmc) {
+                auto index = (std::uint32_t) i;
+                sample.origin = sample_quad(corners(sc, p).vertices, sc.split[p], sobol(index, 0, seed),
+                                            sobol(index, 1, seed), sobol(index, 2, seed));
+                sample.direction = sample_hemi(sc.normal[p], sobol(index, 3, seed), sobol(index, 4, seed));
+            } else {
+                sample.origin = sample_quad(corners(sc, p).vertices, sc.split[p]);
+                sample.direction = sample_hemi(
+                        sc.normal[p]); // TODO: precompute tangent and bi-tangent for each patch?
+            }
+            sample.origin += lift * sc.normal[p];
+
+            hit nearest = intersect(sample, world, ERR);
+
+            /* Patches only take in light on their front side, like they only give it off there */
+            if (nearest.hit && nearest.id != p && glm::dot(sample.direction, sc.normal[nearest.id]) < 0.0f) {
+                p_recieved[nearest.id] +=
+                        (1.0f / N_samples) * total_unshot * color[material[nearest.id]];
+            }
+        }
+
+        N_prev += N_i;
+    }
+}
+
 /* Local-line stohastic incremental Jacobi Radiosity (sec. 6.3 Advanced GI) */
-void local_line(std::vector<patch *> &primitives, const settings &s, const bvh_node *world, stats &stat) {
+void local_line(scene &sc, const settings &s, const scene_bvh &world, stats &stat) {
 
     double sijia_start = glfwGetTime();
     stat.events[EVENT::SIJIA_BEGIN] = glfwGetTime();
 
-    for (auto p : primitives) {
-        p->p_total = p->emit * p->area;
-        p->p_unshot = p->emit * p->area;
-        p->p_recieved = glm::vec3(0.0f);
+    for (int wave_len = 0; wave_len < 3; ++wave_len) {
+        for (std::uint32_t p = 0; p < sc.size; p++) {
+            sc.p_total[wave_len][p] = emittance(sc, wave_len, p) * sc.area[p];
+            sc.p_unshot[wave_len][p] = emittance(sc, wave_len, p) * sc.area[p];
+            sc.p_recieved[wave_len][p] = 0.0f;
+        }
     }
 
+    sc.pass = 0;
     int iteration_count = 0;
 
 /*    GLuint dbg_VAO, dbg_VBO;
@@ -384,25 +782,25 @@ void local_line(std::vector<patch *> &primitives, const settings &s, const bvh_n
     /* Run the simulation for each wavelength */
     for (int wave_len = 0; wave_len < 3; ++wave_len) {
 
+        /* Plain arrays of one wavelength, so the power update below vectorizes */
+        float *p_total = sc.p_total[wave_len].data();
+        float *p_unshot = sc.p_unshot[wave_len].data();
+        float *p_recieved = sc.p_recieved[wave_len].data();
+
         /* Init total powers to zero */
         float total_unshot(0.0f);
         float last_unshot(0.0f);
         float total_power(0.0f);
 
         /* Init power for fixed wavelength */
-        for (auto p : primitives) {
-            total_unshot += p->p_unshot[wave_len];
-            total_power += p->p_total[wave_len];
+        for (std::uint32_t p = 0; p < sc.size; p++) {
+            total_unshot += p_unshot[p];
+            total_power += p_total[p];
         }
 
-        /* Stratified sampling */
-        long long N_prev;
-        float q;
-
         /* Incremental shooting */
         while (total_unshot > 1e-7) {
             auto N_samples = (long long) (s.TOTAL_RAYS * total_unshot / total_power);
-            float xi = unilateral(mt);
 
             if (s.verbose) {
                 std::cout << "Unshot "
@@ -410,39 +808,20 @@ void local_line(std::vector<patch *> &primitives, const settings &s, const bvh_n
                           << total_unshot << "\r" << std::flush;
             }
 
-            N_prev = 0;
-            q = 0;
-
-            for (auto p : primitives) {
-                if (N_prev == N_samples) { break; }
-                auto q_i = p->p_unshot[wave_len] / total_unshot;
-                q += q_i;
-                long N_i = (long) glm::floor(N_samples * q + xi) - N_prev;
-
-                for (long i = 0; i < N_i; ++i) {
-                    glm::vec3 x = sample_point(p);
-                    ray sample = {x, sample_hemi(
-                            p->normal)}; // TODO: precompute tangent and bi-tangent for each patch?
-                    hit nearest = intersect(sample, world, primitives, s.ERR);
-
-                    if (nearest.hit && nearest.p != p) {
-                        nearest.p->p_recieved[wave_len] +=
-                                (1.0f / N_samples) * total_unshot * nearest.p->color[wave_len];
-                    }
-                }
+            shoot(sc, wave_len, N_samples, total_unshot, world, s.ERR, s.qmc);
 
-                N_prev += N_i;
+            for (std::uint32_t p = 0; p < sc.size; p++) {
+                p_total[p] += p_recieved[p];
+                p_unshot[p] = p_recieved[p];
+                p_recieved[p] = 0.0f;
             }
 
             total_power = 0.0f;
             total_unshot = 0.0f;
 
-            for (auto p : primitives) {
-                p->p_total[wave_len] += p->p_recieved[wave_len];
-                p->p_unshot[wave_len] = p->p_recieved[wave_len];
-                p->p_recieved = glm::vec3(0.0f);
-                total_unshot += p->p_unshot[wave_len];
-                total_power += p->p_total[wave_len];
+            for (std::uint32_t p = 0; p < sc.size; p++) {
+                total_unshot += p_unshot[p];
+                total_power += p_total[p];
             }
 
             ++iteration_count;
@@ -451,22 +830,43 @@ void local_line(std::vector<patch *> &primitives, const settings &s, const bvh_n
         if (s.verbose) { std::cout << std::endl; }
     }
 
-    for (auto p : primitives) {
-        for (int wave_len = 0; wave_len < 3; wave_len++) {
-            if (p->area < 1e-2) {
-                p->colors[0][wave_len] =
-                p->colors[1][wave_len] =
-                p->colors[2][wave_len] = p->p_total[wave_len];
-            } else {
-                p->colors[0][wave_len] =
-                p->colors[1][wave_len] =
-                p->colors[2][wave_len] = p->p_total[wave_len] / p->area;
-            }
-        }
-    }
+    vertex_radiosity(sc);
 
     double sijia_end = glfwGetTime();
 
     stat.events[EVENT::SIJIA_END] = glfwGetTime();
     stat.iterations_number = iteration_count;
 }
+
+/* Regular (non-incremental) stochastic Jacobi step: every patch shoots its total power
+ * once more, which resolves the current mesh starting from an already converged estimate */
+void jacobi_iteration(scene &sc, long long rays, const scene_bvh &world, float ERR, bool qmc) {
+    for (int wave_len = 0; wave_len < 3; ++wave_len) {
+        float *p_total = sc.p_total[wave_len].data();
+        float *p_unshot = sc.p_unshot[wave_len].data();
+        float *p_recieved = sc.p_recieved[wave_len].data();
+        const float *emit = sc.emit[wave_len].data();
+        const std::uint16_t *material = sc.material.data();
+
+        float total_unshot(0.0f);
+
+        for (std::uint32_t p = 0; p < sc.size; p++) {
+            p_unshot[p] = p_total[p];
+            p_total[p] = emit[material[p]] * sc.area[p];
+            p_recieved[p] = 0.0f;
+            total_unshot += p_unshot[p];
+        }
+
+        if (total_unshot > 0.0f) {
+            shoot(sc, wave_len, rays, total_unshot, world, ERR, qmc);
+        }
+
+        for (std::uint32_t p = 0; p < sc.size; p++) {
+            p_total[p] += p_recieved[p];
+            p_unshot[p] = 0.0f;
+            p_recieved[p] = 0.0f;
+        }
+    }
+
+    vertex_radiosity(sc);
+}
@@ -0,0 +1,231 @@
+#include "../includes/refine.h"
+#include "../includes/radiosity.h"
+#include "../includes/utils.h"
+
+#include <unordered_map>
+#include <map>
+
+const std::uint32_t NONE = 0xFFFFFFFFu;
+
+struct edge {
+    std::uint32_t patches[2];
+};
+
+inline std::uint64_t edge_key(std::uint32_t a, std::uint32_t b) {
+    return (a < b) ? ((std::uint64_t) a << 32) | b : ((std::uint64_t) b << 32) | a;
+}
+
+inline float luminance(const scene &sc, std::uint32_t p) {
+    float power = 0.2126f * sc.p_total[0][p] + 0.7152f * sc.p_total[1][p] + 0.0722f * sc.p_total[2][p];
+    return power / sc.area[p];
+}
+
+inline bool emitter(const scene &sc, std::uint32_t p) {
+    return emittance(sc, 0, p) > 0.0f || emittance(sc, 1, p) > 0.0f || emittance(sc, 2, p) > 0.0f;
+}
+
+/* Child patch inherits the material and its share of the parent's power */
+void add_patch(scene &sc, const scene &old, std::uint32_t parent,
+               std::uint32_t a, std::uint32_t b, std::uint32_t c, std::uint32_t d) {
+    auto p = (std::uint32_t) sc.normal.size();
+
+    sc.indices.insert(sc.indices.end(), {a, b, c, d});
+
+    sc.normal.push_back(old.normal[parent]);
+    sc.area.push_back(quad_area(corners(sc, p).vertices));
+    sc.split.push_back(quad_split(corners(sc, p).vertices));
+    sc.material.push_back(old.material[parent]);
+
+    float share = (old.area[parent] > 0.0f) ? sc.area[p] / old.area[parent] : 1.0f;
+
+    for (int wave_len = 0; wave_len < 3; wave_len++) {
+        sc.p_total[wave_len].push_back(old.p_total[wave_len][parent] * share);
+        sc.p_unshot[wave_len].push_back(old.p_unshot[wave_len][parent] * share);
+        sc.p_recieved[wave_len].push_back(0.0f);
+    }
+}
+
+inline std::uint64_t edge_key(const scene &sc, std::uint32_t p, int v) {
+    int n = corners_count(sc, p);
+    return edge_key(sc.indices[MAX_CORNERS * p + v], sc.indices[MAX_CORNERS * p + (v + 1) % n]);
+}
+
+/* Adaptive meshing: patches whose radiosity differs strongly from an edge neighbour
+ * are split in four. Neighbouring triangles left with one split edge are split in two,
+ * neighbouring quads are fanned around their center, so no T-junctions appear.
+ * Returns the number of patches split in four */
+std::uint32_t refine(scene &sc, std::vector<instance> &instances, float threshold) {
+
+    /* 1. Edge adjacency, only patches of one smooth surface share vertices */
+    std::unordered_map<std::uint64_t, edge> edges;
+
+    for (std::uint32_t p = 0; p < sc.size; p++) {
+        for (int v = 0; v < corners_count(sc, p); v++) {
+            auto res = edges.emplace(edge_key(sc, p, v), edge{{p, NONE}});
+
+            if (!res.second) {
+                res.first->second.patches[1] = p;
+            }
+        }
+    }
+
+    /* 2. Mark the patches on both sides of a strong gradient */
+    std::vector<bool> split(sc.size, false);
+
+    for (const auto &e : edges) {
+        std::uint32_t a = e.second.patches[0];
+        std::uint32_t b = e.second.patches[1];
+
+        if (b == NONE || emitter(sc, a) || emitter(sc, b)) {
+            continue;
+        }
+
+        float B_a = luminance(sc, a);
+        float B_b = luminance(sc, b);
+
+        if (glm::abs(B_a - B_b) > threshold * std::max(B_a, B_b)) {
+            split[a] = split[b] = true;
+        }
+    }
+
+    /* 3. Split edges, a triangle with two of them is split in four as well */
+    std::unordered_map<std::uint64_t, std::uint32_t> midpoints;
+    std::uint32_t split_count = 0;
+    bool changed = true;
+
+    while (changed) {
+        changed = false;
+
+        for (std::uint32_t p = 0; p < sc.size; p++) {
+            if (split[p]) {
+                for (int v = 0; v < corners_count(sc, p); v++) {
+                    midpoints.emplace(edge_key(sc, p, v), NONE);
+                }
+                continue;
+            }
+
+            if (is_quad(sc, p)) {
+                continue;
+            }
+
+            int split_edges = 0;
+            for (int v = 0; v < 3; v++) {
+                split_edges += midpoints.count(edge_key(sc, p, v));
+            }
+
+            if (split_edges >= 2) {
+                split[p] = true;
+                changed = true;
+            }
+        }
+    }
+
+    for (std::uint32_t p = 0; p < sc.size; p++) {
+        split_count += split[p];
+    }
+
+    if (split_count == 0) {
+        return 0;
+    }
+
+    /* 4. Rebuild the patch arrays instance by instance, so instances stay contiguous */
+    scene old = std::move(sc);
+    sc = {};
+    sc.vertices = old.vertices;
+    sc.material_name = old.material_name;
+
+    for (int wave_len = 0; wave_len < 3; wave_len++) {
+        sc.color[wave_len] = old.color[wave_len];
+        sc.emit[wave_len] = old.emit[wave_len];
+    }
+
+    for (auto &m : midpoints) {
+        m.second = (std::uint32_t) sc.vertices.size();
+        sc.vertices.push_back((sc.vertices[m.first >> 32] + sc.vertices[m.first & 0xFFFFFFFFu]) / 2.0f);
+    }
+
+    std::map<std::size_t, std::size_t> mesh_ids;
+    std::size_t meshes_count = 0;
+
+    for (auto &inst : instances) {
+        auto prim_base = (std::uint32_t) sc.normal.size();
+        bool refined = false;
+
+        for (std::uint32_t p = inst.prim_base; p < inst.prim_base + inst.prim_num; p++) {
+            std::uint32_t c[MAX_CORNERS], m[MAX_CORNERS];
+            int n = corners_count(old, p);
+            int split_edges = 0;
+
+            for (int v = 0; v < MAX_CORNERS; v++) {
+                c[v] = old.indices[MAX_CORNERS * p + v];
+            }
+
+            for (int v = 0; v < n; v++) {
+                auto mid = midpoints.find(edge_key(c[v], c[(v + 1) % n]));
+                m[v] = (mid == midpoints.end()) ? NONE : mid->second;
+                split_edges += (m[v] != NONE);
+            }
+
+            refined |= (split_edges > 0);
+
+            if (split_edges == 0) {
+                add_patch(sc, old, p, c[0], c[1], c[2], c[3]);
+            } else if (n == 4) {
+                auto center = (std::uint32_t) sc.vertices.size();
+                sc.vertices.push_back((sc.vertices[c[0]] + sc.vertices[c[1]] +
+                                       sc.vertices[c[2]] + sc.vertices[c[3]]) / 4.0f);
+
+                for (int v = 0; v < 4; v++) {
+                    if (split_edges == 4) {
+                        add_patch(sc, old, p, c[v], m[v], center, m[(v + 3) % 4]);
+                    } else if (m[v] == NONE) {
+                        add_patch(sc, old, p, center, c[v], c[(v + 1) % 4], c[(v + 1) % 4]);
+                    } else {
+                        add_patch(sc, old, p, center, c[v], m[v], m[v]);
+                        add_patch(sc, old, p, center, m[v], c[(v + 1) % 4], c[(v + 1) % 4]);
+                    }
+                }
+            } else if (split_edges == 3) {
+                add_patch(sc, old, p, c[0], m[0], m[2], m[2]);
+                add_patch(sc, old, p, m[0], c[1], m[1], m[1]);
+                add_patch(sc, old, p, m[2], m[1], c[2], c[2]);
+                add_patch(sc, old, p, m[0], m[1], m[2], m[2]);
+            } else {
+                /* Rotate so that the split edge is c[0] -> c[1], keeping the winding */
+                int v = (m[0] != NONE) ? 0 : (m[1] != NONE) ? 1 : 2;
+                add_patch(sc, old, p, c[v], m[v], c[(v + 2) % 3], c[(v + 2) % 3]);
+                add_patch(sc, old, p, m[v], c[(v + 1) % 3], c[(v + 2) % 3], c[(v + 2) % 3]);
+            }
+        }
+
+        /* A refined instance no longer shares its shape with the others */
+        inst.prim_base = prim_base;
+        inst.prim_num = (std::uint32_t) sc.normal.size() - prim_base;
+
+        if (refined) {
+            inst.mesh = meshes_count++;
+            inst.to_world = inst.to_object = glm::mat4(1.0f);
+        } else {
+            auto id = mesh_ids.find(inst.mesh);
+            if (id == mesh_ids.end()) {
+                id = mesh_ids.emplace(inst.mesh, meshes_count++).first;
+            }
+            inst.mesh = id->second;
+        }
+    }
+
+    sc.size = (std::uint32_t) sc.normal.size();
+    find_emitters(sc);
+
+    sc.vertex_patch.assign(sc.vertices.size(), NONE);
+    for (std::uint32_t i = 0; i < sc.indices.size(); i++) {
+        if (sc.vertex_patch[sc.indices[i]] == NONE) {
+            sc.vertex_patch[sc.indices[i]] = i / MAX_CORNERS;
+        }
+    }
+
+    sc.colors.assign(sc.vertices.size(), glm::vec3(0.0f));
+    vertex_radiosity(sc);
+
+    return split_count;
+}
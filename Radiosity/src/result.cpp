@@ -0,0 +1,339 @@
+#include "../includes/result.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <glm/gtc/packing.hpp>
+
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+const std::uint64_t FNV_OFFSET = 0xcbf29ce484222325ull;
+const std::uint64_t FNV_PRIME = 0x100000001b3ull;
+
+std::uint64_t checksum(const void *data, std::size_t bytes, std::uint64_t hash) {
+    auto p = (const char *) data;
+    std::size_t words = bytes / sizeof(std::uint64_t);
+
+    for (std::size_t i = 0; i < words; i++) {
+        std::uint64_t w;
+        std::memcpy(&w, p + i * sizeof(w), sizeof(w));
+        hash = (hash ^ w) * FNV_PRIME;
+    }
+
+    for (std::size_t i = words * sizeof(std::uint64_t); i < bytes; i++) {
+        hash = (hash ^ (std::uint8_t) p[i]) * FNV_PRIME;
+    }
+
+    return hash;
+}
+
+/* Maps a whole file read-only, nullptr if it cannot */
+const char *map_file(const std::string &path, std::size_t &size) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    struct stat info = {};
+    fstat(fd, &info);
+    size = (std::size_t) info.st_size;
+
+    void *mapped = (size > 0) ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+
+    return (mapped == MAP_FAILED) ? nullptr : (const char *) mapped;
+}
+
+std::uint64_t hash_file(const std::string &path) {
+    std::size_t size = 0;
+    const char *data = map_file(path, size);
+
+    if (data == nullptr) {
+        return 0;
+    }
+
+    madvise((void *) data, size, MADV_SEQUENTIAL);
+    std::uint64_t hash = checksum(data, size, FNV_OFFSET);
+    munmap((void *) data, size);
+
+    return hash;
+}
+
+inline std::uint64_t page_align(std::uint64_t offset) {
+    return (offset + RESULT_ALIGN - 1) / RESULT_ALIGN * RESULT_ALIGN;
+}
+
+std::size_t format_size(std::uint32_t format) {
+    return (format == RESULT_FLOAT16 || format == RESULT_UNORM16) ? 2 : 4;
+}
+
+result_header make_header(const scene &sc, const std::vector<std::uint32_t> &indices, const settings &s,
+                          const tonemap_params &tm) {
+    result_header header = {};
+    std::memcpy(header.magic, RESULT_MAGIC, sizeof(RESULT_MAGIC));
+    header.version = RESULT_VERSION;
+    header.sections = 3;
+    header.vertex_count = sc.vertices.size();
+    header.triangle_count = indices.size() / 3;
+    header.mesh_hash = hash_file(s.mesh_path);
+    header.rays = (std::uint64_t) s.TOTAL_RAYS;
+    header.err = s.ERR;
+    header.solver = s.hierarchical ? RESULT_HIERARCHICAL : (s.adaptive ? RESULT_ADAPTIVE : RESULT_LOCAL_LINE);
+    header.key = tm.key;
+    header.white = tm.white;
+    header.tonemap_mode = tm.mode;
+    header.tonemap_operator = tm.op;
+    std::memcpy(header.curve, tm.curve, sizeof(tm.curve));
+
+    for (int i = 0; i < 3; i++) {
+        header.log_average[i] = tm.log_average[i];
+        header.position_offset[i] = 0.0f;
+        header.position_scale[i] = 1.0f;
+    }
+
+    return header;
+}
+
+bool write_result(const std::string &path, result_header &header, result_section *sections, const void **data) {
+    header.checksum = FNV_OFFSET;
+
+    std::uint64_t offset = sizeof(result_header) + 3 * sizeof(result_section);
+    for (int i = 0; i < 3; i++) {
+        sections[i].offset = page_align(offset);
+        offset = sections[i].offset + sections[i].bytes;
+        header.checksum = checksum(data[i], sections[i].bytes, header.checksum);
+    }
+
+    std::ofstream file(path.c_str(), std::ios::out | std::ios::binary);
+    if (!file) {
+        std::cerr << "Cannot write " << path << std::endl;
+        return false;
+    }
+
+    file.write((const char *) &header, sizeof(header));
+    file.write((const char *) sections, 3 * sizeof(result_section));
+
+    const std::vector<char> padding(RESULT_ALIGN, 0);
+    offset = sizeof(result_header) + 3 * sizeof(result_section);
+
+    for (int i = 0; i < 3; i++) {
+        file.write(padding.data(), sections[i].offset - offset);
+        file.write((const char *) data[i], sections[i].bytes);
+        offset = sections[i].offset + sections[i].bytes;
+    }
+
+    return (bool) file;
+}
+
+bool save_result(const std::string &path, const scene &sc, const std::vector<float> &colors,
+                 const std::vector<std::uint32_t> &indices, const settings &s, const tonemap_params &tm) {
+    static_assert(sizeof(glm::vec3) == 3 * sizeof(float), "positions are written as they are");
+
+    result_header header = make_header(sc, indices, s, tm);
+    result_section sections[3] = {
+        {RESULT_POSITIONS, RESULT_FLOAT32, 3, 0, 0, sc.vertices.size() * sizeof(glm::vec3)},
+        {RESULT_COLORS, RESULT_FLOAT32, 3, 0, 0, colors.size() * sizeof(float)},
+        {RESULT_INDICES, RESULT_UINT32, 1, 0, 0, indices.size() * sizeof(std::uint32_t)},
+    };
+    const void *data[3] = {sc.vertices.data(), colors.data(), indices.data()};
+
+    return write_result(path, header, sections, data);
+}
+
+bool save_compact_result(const std::string &path, const scene &sc, const std::vector<float> &colors,
+                         const std::vector<std::uint32_t> &indices, const settings &s, const tonemap_params &tm) {
+    const float UNORM16_MAX = 65535.0f;
+    const float FLOAT16_MAX = 65504.0f;
+
+    result_header header = make_header(sc, indices, s, tm);
+
+    glm::vec3 min(INF), max(-INF);
+    for (const auto &v : sc.vertices) {
+        min = glm::min(min, v);
+        max = glm::max(max, v);
+    }
+
+    glm::vec3 extent = sc.vertices.empty() ? glm::vec3(0.0f) : max - min;
+    glm::vec3 inv_extent;
+
+    for (int i = 0; i < 3; i++) {
+        header.position_offset[i] = sc.vertices.empty() ? 0.0f : min[i];
+        header.position_scale[i] = extent[i];
+        inv_extent[i] = (extent[i] > 0.0f) ? 1.0f / extent[i] : 0.0f;
+    }
+
+    std::vector<std::uint16_t> positions(3 * sc.vertices.size());
+    for (std::size_t v = 0; v < sc.vertices.size(); v++) {
+        glm::vec3 unit = glm::clamp((sc.vertices[v] - min) * inv_extent, 0.0f, 1.0f);
+        for (int i = 0; i < 3; i++) {
+            positions[v * 3 + i] = (std::uint16_t) std::lround(unit[i] * UNORM16_MAX);
+        }
+    }
+
+    std::vector<std::uint16_t> halves(colors.size());
+    for (std::size_t i = 0; i < colors.size(); i++) {
+        halves[i] = glm::packHalf1x16(glm::min(colors[i], FLOAT16_MAX));
+    }
+
+    result_section sections[3] = {
+        {RESULT_POSITIONS, RESULT_UNORM16, 3, 0, 0, positions.size() * sizeof(std::uint16_t)},
+        {RESULT_COLORS, RESULT_FLOAT16, 3, 0, 0, halves.size() * sizeof(std::uint16_t)},
+        {RESULT_INDICES, RESULT_UINT32, 1, 0, 0, indices.size() * sizeof(std::uint32_t)},
+    };
+    const void *data[3] = {positions.data(), halves.data(), indices.data()};
+
+    return write_result(path, header, sections, data);
+}
+
+/* Section holds 'count' items of 'values' values each, sizes are compared without overflowing */
+bool holds(const result_section *s, std::uint64_t count, std::uint64_t values) {
+    std::uint64_t item = values * format_size(s->format);
+    return s->bytes % item == 0 && s->bytes / item == count;
+}
+
+/* Every triangle corner must name a vertex of the file, the GPU would read past the buffer */
+bool indices_in_range(const std::uint32_t *indices, std::uint64_t count, std::uint64_t vertex_count) {
+    for (std::uint64_t i = 0; i < count; i++) {
+        if (indices[i] >= vertex_count) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool map_result(const std::string &path, result_file &result) {
+    result = {};
+    result.data = map_file(path, result.size);
+
+    if (result.data == nullptr) {
+        std::cerr << "Cannot map " << path << std::endl;
+        return false;
+    }
+
+    /* Every page is read by the checksum and then by the upload */
+    madvise((void *) result.data, result.size, MADV_WILLNEED);
+
+    auto header = (const result_header *) result.data;
+    auto sections = (const result_section *) (result.data + sizeof(result_header));
+    result.header = header;
+
+    bool valid = result.size >= sizeof(result_header) &&
+                 std::memcmp(header->magic, RESULT_MAGIC, sizeof(RESULT_MAGIC)) == 0 &&
+                 header->version == RESULT_VERSION &&
+                 sizeof(result_header) + header->sections * sizeof(result_section) <= result.size;
+
+    std::uint64_t hash = FNV_OFFSET;
+
+    for (std::uint32_t i = 0; valid && i < header->sections; i++) {
+        const result_section &s = sections[i];
+
+        valid = s.type <= RESULT_INDICES && result.sections[s.type] == nullptr && s.offset % RESULT_ALIGN == 0 &&
+                s.bytes <= result.size && s.offset <= result.size - s.bytes;
+        if (valid) {
+            result.sections[s.type] = &s;
+            hash = checksum(result.data + s.offset, s.bytes, hash);
+        }
+    }
+
+    /* The layout this build can draw */
+    for (int i = 0; valid && i < 3; i++) {
+        valid = result.sections[i] != nullptr;
+    }
+
+    auto positions = result.sections[RESULT_POSITIONS];
+    auto colors = result.sections[RESULT_COLORS];
+    auto indices = result.sections[RESULT_INDICES];
+
+    valid = valid &&
+            (positions->format == RESULT_FLOAT32 || positions->format == RESULT_UNORM16) &&
+            positions->components == 3 && holds(positions, header->vertex_count, 3) &&
+            (colors->format == RESULT_FLOAT32 || colors->format == RESULT_FLOAT16) &&
+            colors->components == 3 && holds(colors, header->vertex_count, 3) &&
+            indices->format == RESULT_UINT32 && holds(indices, header->triangle_count, 3);
+
+    if (!valid) {
+        std::cerr << path << " is not a version " << RESULT_VERSION << " result, rerun with -s" << std::endl;
+        unmap_result(result);
+        return false;
+    }
+
+    if (hash != header->checksum) {
+        std::cerr << path << " is damaged: checksum mismatch" << std::endl;
+        unmap_result(result);
+        return false;
+    }
+
+    if (!indices_in_range((const std::uint32_t *) (result.data + indices->offset), 3 * header->triangle_count,
+                          header->vertex_count)) {
+        std::cerr << path << " is damaged: a triangle index is out of range" << std::endl;
+        unmap_result(result);
+        return false;
+    }
+
+    return true;
+}
+
+void unmap_result(result_file &result) {
+    if (result.data != nullptr) {
+        munmap((void *) result.data, result.size);
+    }
+
+    result = {};
+}
+
+tonemap_params result_tonemap(const result_file &result) {
+    const float *log_average = result.header->log_average;
+    tonemap_params tm = {result.header->key, result.header->white, (TONEMAP_MODE) result.header->tonemap_mode,
+                         glm::vec3(log_average[0], log_average[1], log_average[2]),
+                         (TONEMAP_OPERATOR) result.header->tonemap_operator, {}};
+    std::memcpy(tm.curve, result.header->curve, sizeof(tm.curve));
+
+    return tm;
+}
+
+std::size_t upload_result(const result_file &result, GLuint *VAO, GLuint *VBO, GLuint *CBO, GLuint *EBO) {
+    const result_section *positions = result.sections[RESULT_POSITIONS];
+    const result_section *colors = result.sections[RESULT_COLORS];
+    const result_section *indices = result.sections[RESULT_INDICES];
+
+    glGenVertexArrays(1, VAO);
+    glGenBuffers(1, VBO);
+    glGenBuffers(1, CBO);
+    glGenBuffers(1, EBO);
+
+    glBindVertexArray(*VAO);
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, *EBO);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices->bytes, result.data + indices->offset, GL_STATIC_DRAW);
+
+    glBindBuffer(GL_ARRAY_BUFFER, *VBO);
+    glBufferData(GL_ARRAY_BUFFER, positions->bytes, result.data + positions->offset, GL_STATIC_DRAW);
+    if (positions->format == RESULT_UNORM16) {
+        /* Normalized to [0, 1], the vertex shader scales them back over the bounds */
+        glVertexAttribPointer(0, positions->components, GL_UNSIGNED_SHORT, GL_TRUE, 0, (GLvoid *) 0);
+    } else {
+        glVertexAttribPointer(0, positions->components, GL_FLOAT, GL_FALSE, 0, (GLvoid *) 0);
+    }
+    glEnableVertexAttribArray(0); // position
+
+    glBindBuffer(GL_ARRAY_BUFFER, *CBO);
+    glBufferData(GL_ARRAY_BUFFER, colors->bytes, result.data + colors->offset, GL_STATIC_DRAW);
+    if (colors->format == RESULT_FLOAT16) {
+        /* Half floats are a vertex format of their own, nothing to decode */
+        glVertexAttribPointer(1, colors->components, GL_HALF_FLOAT, GL_FALSE, 0, (GLvoid *) 0);
+    } else {
+        glVertexAttribPointer(1, colors->components, GL_FLOAT, GL_FALSE, 0, (GLvoid *) 0);
+    }
+    glEnableVertexAttribArray(1); // color
+
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindVertexArray(0);
+
+    return indices->bytes / sizeof(std::uint32_t);
+}
@@ -55,6 +55,11 @@ namespace utils {
         glUseProgram(this->program);
     }
 
+    void shader::set_uniform_array(const std::string &var_string, const float *data, int count) const {
+        GLint loc = glGetUniformLocation(this->program, var_string.c_str());
+        glUniform1fv(loc, count, data);
+    }
+
     template<>
     void shader::set_uniform<glm::mat4>(const std::string &var_string, const glm::mat4 &data) const {
         GLint loc = glGetUniformLocation(this->program, var_string.c_str());
@@ -102,4 +107,16 @@ namespace utils {
         GLint loc = glGetUniformLocation(this->program, var_string.c_str());
         glUniform2f(loc, data.x, data.y);
     }
+
+    template<>
+    void shader::set_uniform<float>(const std::string &var_string, const float &&data) const {
+        GLint loc = glGetUniformLocation(this->program, var_string.c_str());
+        glUniform1f(loc, data);
+    }
+
+    template<>
+    void shader::set_uniform<int>(const std::string &var_string, const int &&data) const {
+        GLint loc = glGetUniformLocation(this->program, var_string.c_str());
+        glUniform1i(loc, data);
+    }
 }
\ No newline at end of file
@@ -0,0 +1,77 @@
+#include "../includes/sobol.h"
+
+/* Primitive polynomials and initial direction numbers of dimensions 2-5 (Joe, Kuo 2008),
+ * the first dimension is the van der Corput sequence */
+const int SOBOL_DEGREE[SOBOL_DIMENSIONS] = {0, 1, 2, 3, 3};
+const std::uint32_t SOBOL_POLYNOMIAL[SOBOL_DIMENSIONS] = {0, 0, 1, 1, 2};
+const std::uint32_t SOBOL_INITIAL[SOBOL_DIMENSIONS][3] = {{}, {1}, {1, 3}, {1, 3, 1}, {1, 1, 1}};
+
+struct sobol_matrices {
+    std::uint32_t v[SOBOL_DIMENSIONS][32];
+
+    sobol_matrices() : v() {
+        for (int k = 0; k < 32; k++) {
+            v[0][k] = 1u << (31 - k);
+        }
+
+        for (int d = 1; d < SOBOL_DIMENSIONS; d++) {
+            int s = SOBOL_DEGREE[d];
+
+            for (int k = 0; k < s; k++) {
+                v[d][k] = SOBOL_INITIAL[d][k] << (31 - k);
+            }
+
+            for (int k = s; k < 32; k++) {
+                v[d][k] = v[d][k - s] ^ (v[d][k - s] >> s);
+                for (int j = 1; j < s; j++) {
+                    v[d][k] ^= ((SOBOL_POLYNOMIAL[d] >> (s - 1 - j)) & 1u) * v[d][k - j];
+                }
+            }
+        }
+    }
+};
+
+const sobol_matrices SOBOL;
+
+std::uint32_t sobol_seed(std::uint32_t a, std::uint32_t b) {
+    /* Boost's hash_combine over a murmur finalized value */
+    a ^= b + 0x9e3779b9u + (a << 6) + (a >> 2);
+    a ^= a >> 16;
+    a *= 0x85ebca6bu;
+    a ^= a >> 13;
+    a *= 0xc2b2ae35u;
+    a ^= a >> 16;
+    return a;
+}
+
+inline std::uint32_t reverse_bits(std::uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+/* Flips each bit depending only on the bits below it, which in reverse order is an Owen scramble */
+inline std::uint32_t laine_karras_permutation(std::uint32_t x, std::uint32_t seed) {
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+float sobol(std::uint32_t i, int dimension, std::uint32_t seed) {
+    std::uint32_t x = 0;
+    for (int k = 0; i != 0; i >>= 1, k++) {
+        if (i & 1u) {
+            x ^= SOBOL.v[dimension][k];
+        }
+    }
+
+    x = reverse_bits(laine_karras_permutation(reverse_bits(x), sobol_seed(seed, (std::uint32_t) dimension)));
+
+    return (float) (x >> 8) * 0x1p-24f;
+}
@@ -3,10 +3,65 @@
 
 #include "../includes/stats.h"
 
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+int open_counter(unsigned long long cache) {
+    perf_event_attr attr = {};
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(attr);
+    attr.config = cache
+                  | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                  | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+perf_counters start_counters() {
+    perf_counters counters = {};
+
+    counters.fd[COUNTER::L1_MISSES] = open_counter(PERF_COUNT_HW_CACHE_L1D);
+    counters.fd[COUNTER::LLC_MISSES] = open_counter(PERF_COUNT_HW_CACHE_LL);
+    counters.fd[COUNTER::TLB_MISSES] = open_counter(PERF_COUNT_HW_CACHE_DTLB);
+
+    for (int fd : counters.fd) {
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    return counters;
+}
+
+void stop_counters(perf_counters &counters, long long *values) {
+    for (int i = 0; i < COUNTER::COUNTERS_NUM; i++) {
+        values[i] = -1;
+
+        if (counters.fd[i] >= 0) {
+            ioctl(counters.fd[i], PERF_EVENT_IOC_DISABLE, 0);
+            if (read(counters.fd[i], &values[i], sizeof(long long)) != sizeof(long long)) {
+                values[i] = -1;
+            }
+            close(counters.fd[i]);
+        }
+    }
+}
+
 void output_stats(stats &stat) {
     std::cout << "[=========STATS=========]" << std::endl;
     std::cout << "| " << std::right << std::setw(15) << "POLYGONS: "
               << std::left << stat.polygons_count << std::endl;
+    std::cout << "| " << std::right << std::setw(15) << "CLEANUP: "
+              << std::left << stat.welded_count << " welded, " << stat.degenerate_count << " degenerate, "
+              << stat.flipped_count << " flipped, " << stat.fanned_count << " fanned" << std::endl;
+    std::cout << "| " << std::right << std::setw(15) << "INSTANCES: "
+              << std::left << stat.instances_count << " (" << stat.meshes_count << " unique)" << std::endl;
     std::cout << "| " << std::right << std::setw(15) << "LIGHTS: "
               << std::left << stat.light_sources_count << std::endl;
     std::cout << "| " << std::right << std::setw(15) << "RAYS: "
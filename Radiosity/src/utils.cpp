@@ -1,11 +1,17 @@
-#define TINYOBJLOADER_IMPLEMENTATION
-
-#include "../includes/tiny_obj_loader.h"
+#include "../includes/obj.h"
+#include "../includes/ply.h"
 #include "../includes/utils.h"
 #include "../includes/radiosity.h"
 
+#include <glm/gtc/matrix_transform.hpp>
+
 #include <dirent.h>
+#include <unordered_map>
+#include <tuple>
+#include <limits>
+#include <algorithm>
 #include <iostream>
+#include <fstream>
 
 void load_settings(const std::string &path, settings &s) {
     std::ifstream file(path.c_str());
@@ -25,16 +31,153 @@ void load_settings(const std::string &path, settings &s) {
             static_cast<float>(s.WINDOW_HEIGHT);
 }
 
-std::vector<patch> load_mesh(const std::string &path, stats &stat) {
-    std::vector<patch> patches;
-    tinyobj::attrib_t attrib;
+/* Shapes that only differ by a translation share one bottom-level BVH */
+bool same_geometry(const scene &sc, std::uint32_t a, std::uint32_t b, std::uint32_t n, glm::vec3 &offset) {
+    const float WELD_ERR = 1e-3f;
+
+    offset = sc.vertices[sc.indices[MAX_CORNERS * b]] - sc.vertices[sc.indices[MAX_CORNERS * a]];
+
+    for (std::uint32_t i = 0; i < MAX_CORNERS * n; i++) {
+        glm::vec3 v_a = sc.vertices[sc.indices[MAX_CORNERS * a + i]];
+        glm::vec3 v_b = sc.vertices[sc.indices[MAX_CORNERS * b + i]];
+
+        if (glm::length(v_b - v_a - offset) > WELD_ERR) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* A quad is kept as one patch if it is planar and convex, otherwise it is triangulated */
+bool flat_quad(const glm::vec3 *v) {
+    const float PLANAR_ERR = 1e-3f;
+
+    glm::vec3 n_012 = glm::cross(v[1] - v[0], v[2] - v[0]);
+    glm::vec3 n_023 = glm::cross(v[2] - v[0], v[3] - v[0]);
+    glm::vec3 n_123 = glm::cross(v[2] - v[1], v[3] - v[1]);
+    glm::vec3 n_130 = glm::cross(v[3] - v[1], v[0] - v[1]);
+
+    float len = glm::length(n_012);
+    if (len == 0.0f || glm::dot(n_012, n_023) <= 0.0f || glm::dot(n_123, n_130) <= 0.0f) {
+        return false;
+    }
+
+    return glm::abs(glm::dot(n_012 / len, v[3] - v[0])) <= PLANAR_ERR * glm::sqrt(len);
+}
+
+/* Point p lies inside or on triangle abc, seen along the face normal n */
+bool in_triangle(const glm::vec3 &p, const glm::vec3 &a, const glm::vec3 &b, const glm::vec3 &c, const glm::vec3 &n) {
+    return glm::dot(glm::cross(b - a, p - a), n) >= 0.0f &&
+           glm::dot(glm::cross(c - b, p - b), n) >= 0.0f &&
+           glm::dot(glm::cross(a - c, p - c), n) >= 0.0f;
+}
 
-    std::vector<tinyobj::shape_t> shapes;
-    std::vector<tinyobj::material_t> materials;
+/* Cuts a face into triangles by ear clipping in its own plane, so the triangles of a concave face
+ * stay inside its outline. Returns false if the face ran out of ears (it crosses itself or is far
+ * from planar), what was left of it is then fanned */
+bool ear_clip(const std::vector<glm::vec3> &vertices, std::vector<std::uint32_t> ring, const glm::vec3 &n,
+              std::vector<std::uint32_t> &triangles) {
+    while (ring.size() > 3) {
+        std::size_t count = ring.size();
+        bool clipped = false;
+
+        for (std::size_t i = 0; i < count && !clipped; i++) {
+            std::uint32_t a = ring[(i + count - 1) % count], b = ring[i], c = ring[(i + 1) % count];
+            const glm::vec3 &A = vertices[a], &B = vertices[b], &C = vertices[c];
+
+            /* A reflex corner is no ear */
+            if (glm::dot(glm::cross(B - A, C - B), n) <= 0.0f) {
+                continue;
+            }
+
+            bool empty = true;
+            for (auto other : ring) {
+                if (other != a && other != b && other != c && in_triangle(vertices[other], A, B, C, n)) {
+                    empty = false;
+                    break;
+                }
+            }
+
+            if (empty) {
+                triangles.insert(triangles.end(), {a, b, c});
+                ring.erase(ring.begin() + i);
+                clipped = true;
+            }
+        }
+
+        if (!clipped) {
+            for (std::size_t v = 2; v < ring.size(); v++) {
+                triangles.insert(triangles.end(), {ring[0], ring[v - 1], ring[v]});
+            }
+            return false;
+        }
+    }
+
+    triangles.insert(triangles.end(), ring.begin(), ring.end());
+
+    return true;
+}
+
+typedef std::tuple<long long, long long, long long, int, int> corner_key; // grid cell, file normal, material
+
+struct corner_hash {
+    std::size_t operator()(const corner_key &k) const {
+        std::uint64_t h = (std::uint64_t) std::get<0>(k) * 0x9E3779B97F4A7C15ull;
+        h = (h ^ (std::uint64_t) std::get<1>(k)) * 0xC2B2AE3D27D4EB4Full;
+        h = (h ^ (std::uint64_t) std::get<2>(k)) * 0x165667B19E3779F9ull;
+        h = (h ^ (std::uint64_t) std::get<3>(k)) * 0x9E3779B97F4A7C15ull;
+        h = (h ^ (std::uint64_t) std::get<4>(k)) * 0xC2B2AE3D27D4EB4Full;
+        return (std::size_t) (h ^ (h >> 29));
+    }
+};
 
+typedef std::unordered_multimap<corner_key, std::uint32_t, corner_hash> weld_grid;
+
+const std::uint32_t NO_VERTEX = std::numeric_limits<std::uint32_t>::max();
+
+/* Corners closer than 'distance' are welded. The grid cells are twice as wide, so a close corner
+ * lies in one of the 2x2x2 cells on the side of the cell boundaries nearest to v */
+corner_key weld_key(const glm::vec3 &v, float distance, int normal_id, int material_id) {
+    glm::vec3 c = glm::floor(v / (2.0f * distance));
+    return std::make_tuple((long long) c.x, (long long) c.y, (long long) c.z, normal_id, material_id);
+}
+
+std::uint32_t find_weld(const weld_grid &grid, const std::vector<glm::vec3> &vertices, const glm::vec3 &v,
+                        float distance, int normal_id, int material_id) {
+    glm::vec3 scaled = v / (2.0f * distance);
+    glm::vec3 base = glm::floor(scaled);
+    glm::vec3 side = glm::vec3(scaled.x - base.x < 0.5f ? -1.0f : 1.0f,
+                               scaled.y - base.y < 0.5f ? -1.0f : 1.0f,
+                               scaled.z - base.z < 0.5f ? -1.0f : 1.0f);
+
+    for (int n = 0; n < 8; n++) {
+        glm::vec3 c = base + glm::vec3(n & 1, (n >> 1) & 1, (n >> 2) & 1) * side;
+        auto key = std::make_tuple((long long) c.x, (long long) c.y, (long long) c.z, normal_id, material_id);
+        auto range = grid.equal_range(key);
+
+        for (auto it = range.first; it != range.second; ++it) {
+            if (glm::length(vertices[it->second] - v) <= distance) {
+                return it->second;
+            }
+        }
+    }
+
+    return NO_VERTEX;
+}
+
+scene load_mesh(const std::string &path, std::vector<instance> &instances, stats &stat) {
+    const float WELD_ERR = 1e-5f;
+    const float AREA_ERR = 1e-9f; // patches below this fraction of the squared diagonal are degenerate
+
+    scene sc = {};
+    std::size_t meshes_count = 0;
+    obj_mesh mesh;
     std::string err;
 
-    bool status = tinyobj::LoadObj(&attrib, &shapes, &materials, &err, path.c_str());
+    /* Scans come as binary PLY, everything else as OBJ */
+    bool ply = path.size() > 4 && path.compare(path.size() - 4, 4, ".ply") == 0;
+    bool status = ply ? load_ply(path, mesh, err) : load_obj(path, mesh, err);
 
     if (!err.empty()) {
         std::cerr << err << std::endl;
@@ -44,134 +187,374 @@ std::vector<patch> load_mesh(const std::string &path, stats &stat) {
         std::exit(1);
     }
 
-    for (auto &shape : shapes) {
-        std::size_t index_offset = 0;
+    /* Material table */
+    if (mesh.materials.size() > MAX_MATERIALS) {
+        std::cerr << "More than " << MAX_MATERIALS << " materials" << std::endl;
+        std::exit(1);
+    }
+
+    for (const auto &material : mesh.materials) {
+        sc.material_name.push_back(material.name);
+
+        for (int wave_len = 0; wave_len < 3; wave_len++) {
+            sc.color[wave_len].push_back(material.diffuse[wave_len]);
+            sc.emit[wave_len].push_back(material.emit[wave_len]);
+        }
+    }
+
+    /* Weld and degeneracy tolerances scale with the scene */
+    glm::vec3 lo(std::numeric_limits<float>::max()), hi(-std::numeric_limits<float>::max());
+    for (const auto &v : mesh.positions) {
+        lo = glm::min(lo, v);
+        hi = glm::max(hi, v);
+    }
+
+    /* File position each vertex was created from, to count the welded ones */
+    std::vector<std::int32_t> vertex_source;
+    std::vector<bool> welded(mesh.positions.size(), false);
 
-//        std::cout << "Loading object \'" << shape.name << "\'" << std::endl;
+    float diagonal = (lo.x <= hi.x) ? glm::length(hi - lo) : 1.0f;
+    float weld_distance = WELD_ERR * diagonal;
+    float min_area = AREA_ERR * diagonal * diagonal;
+
+    for (std::size_t shape = 0; shape < mesh.shape_first.size(); shape++) {
+        auto prim_base = (std::uint32_t) sc.normal.size();
+        weld_grid shared_vertices; // shapes are welded on their own, they may be instanced
+        std::size_t last_face = (shape + 1 < mesh.shape_first.size())
+                                ? mesh.shape_first[shape + 1]
+                                : mesh.face_material.size();
 
         /* Vertices */
-        for (std::size_t f = 0; f < shape.mesh.num_face_vertices.size(); f++) {
-            int fv = shape.mesh.num_face_vertices[f];
-            patch p = {};
+        for (std::size_t f = mesh.shape_first[shape]; f < last_face; f++) {
+            int current_material_id = mesh.face_material[f];
+            std::vector<std::uint32_t> face;
+            glm::vec3 file_normal(0.0f);
 
-            if (fv != 3) {
-                std::cerr << "Scene is not triangulated!" << std::endl;
+            if (current_material_id < 0) {
+                std::cerr << "Material not specified" << std::endl;
                 std::exit(1);
             }
 
-            for (std::size_t v = 0; v < fv; v++) {
-                tinyobj::index_t idx = shape.mesh.indices[index_offset + v];
+            for (std::uint32_t c = mesh.face_first[f]; c < mesh.face_first[f + 1]; c++) {
+                std::int32_t position_id = mesh.corner_vertex[c];
+                std::int32_t normal_id = mesh.corner_normal[c];
+                const glm::vec3 &position = mesh.positions[position_id];
+
+                /* The file normal only orients the face and keeps hard edges apart */
+                if (normal_id >= 0) {
+                    file_normal += mesh.normals[normal_id];
+                }
+
+                /* Coincident corners on the same surface and material become one vertex */
+                std::uint32_t shared = find_weld(shared_vertices, sc.vertices, position, weld_distance,
+                                                 normal_id, current_material_id);
+
+                if (shared == NO_VERTEX) {
+                    shared = (std::uint32_t) sc.vertices.size();
+                    shared_vertices.emplace(weld_key(position, weld_distance, normal_id, current_material_id), shared);
+                    sc.vertices.push_back(position);
+                    vertex_source.push_back(position_id);
+                } else if (vertex_source[shared] != position_id && !welded[position_id]) {
+                    welded[position_id] = true;
+                    ++stat.welded_count;
+                }
+
+                /* Welding can collapse an edge, the repeated corner is dropped */
+                if (face.empty() || face.back() != shared) {
+                    face.push_back(shared);
+                }
+            }
 
-                p.vertices[v] = glm::vec3(
-                        attrib.vertices[3 * idx.vertex_index + 0],
-                        attrib.vertices[3 * idx.vertex_index + 1],
-                        attrib.vertices[3 * idx.vertex_index + 2]);
+            while (face.size() > 1 && face.front() == face.back()) {
+                face.pop_back();
+            }
 
-                p.normal = glm::vec3(
-                        attrib.normals[3 * idx.normal_index + 0],
-                        attrib.normals[3 * idx.normal_index + 1],
-                        attrib.normals[3 * idx.normal_index + 2]);
+            if (face.size() < 3) {
+                ++stat.degenerate_count;
+                continue;
             }
 
-            p.vertices[3] = (p.vertices[0] + p.vertices[1] + p.vertices[2]) / 3.0f; // centroid
-            p.normal = glm::normalize(p.normal);
+            /* Newell normal of the whole face, the winding is turned to agree with the file */
+            glm::vec3 face_normal(0.0f);
+            for (std::size_t v = 0; v < face.size(); v++) {
+                face_normal += glm::cross(sc.vertices[face[v]], sc.vertices[face[(v + 1) % face.size()]]);
+            }
 
-            /* Materials */
-            int current_material_id = shape.mesh.material_ids[f];
+            if (glm::dot(face_normal, file_normal) < 0.0f) {
+                std::reverse(face.begin(), face.end());
+                face_normal = -face_normal;
+                ++stat.flipped_count;
+            }
 
-            if (current_material_id < 0) {
-                std::cerr << "Material not specified" << std::endl;
-                std::exit(1);
+            auto add_patch = [&](std::uint32_t a, std::uint32_t b, std::uint32_t c, std::uint32_t d) {
+                const glm::vec3 v[4] = {sc.vertices[a], sc.vertices[b], sc.vertices[c], sc.vertices[d]};
+                float patch_area = quad_area(v);
+
+                /* Slivers absorb rays and have no radiosity to speak of */
+                if (patch_area <= min_area) {
+                    ++stat.degenerate_count;
+                    return;
+                }
+
+                sc.indices.insert(sc.indices.end(), {a, b, c, d});
+                sc.normal.push_back(glm::normalize(glm::cross(v[2] - v[0], v[3] - v[1])));
+                sc.area.push_back(patch_area);
+                sc.split.push_back(quad_split(v));
+                sc.material.push_back((std::uint16_t) current_material_id);
+
+                ++stat.polygons_count;
+            };
+
+            if (face.size() == 4) {
+                const glm::vec3 v[4] = {sc.vertices[face[0]], sc.vertices[face[1]],
+                                        sc.vertices[face[2]], sc.vertices[face[3]]};
+                if (flat_quad(v)) {
+                    add_patch(face[0], face[1], face[2], face[3]);
+                    continue;
+                }
+
+                /* A concave quad is cut along the diagonal through its reflex corner, the other one leaves it */
+                std::size_t reflex = 0;
+                for (std::size_t c = 0; c < 4; c++) {
+                    glm::vec3 turn = glm::cross(v[c] - v[(c + 3) % 4], v[(c + 1) % 4] - v[c]);
+                    if (glm::dot(turn, face_normal) < 0.0f) {
+                        reflex = c;
+                        break;
+                    }
+                }
+
+                std::uint32_t a = face[reflex], b = face[(reflex + 1) % 4];
+                std::uint32_t c = face[(reflex + 2) % 4], d = face[(reflex + 3) % 4];
+                add_patch(a, b, c, c);
+                add_patch(a, c, d, d);
+                continue;
             }
 
-            p.color = glm::vec3(
-                    materials[current_material_id].diffuse[0],
-                    materials[current_material_id].diffuse[1],
-                    materials[current_material_id].diffuse[2]);
+            /* Anything else is clipped into triangles */
+            std::vector<std::uint32_t> triangles;
+            if (!ear_clip(sc.vertices, face, face_normal, triangles)) {
+                ++stat.fanned_count;
+            }
 
-            p.area = area(p);
+            for (std::size_t t = 0; t < triangles.size(); t += 3) {
+                add_patch(triangles[t], triangles[t + 1], triangles[t + 2], triangles[t + 2]);
+            }
+        }
+
+        /* Instancing */
+        instance inst = {};
+        inst.prim_base = prim_base;
+        inst.prim_num = (std::uint32_t) sc.normal.size() - prim_base;
+        inst.mesh = meshes_count;
+        inst.to_world = inst.to_object = glm::mat4(1.0f);
 
-            p.emit = glm::vec3(
-                    materials[current_material_id].ambient[0],
-                    materials[current_material_id].ambient[1],
-                    materials[current_material_id].ambient[2]);
+        if (inst.prim_num == 0) {
+            continue;
+        }
 
-            ++stat.polygons_count;
+        for (const auto &other : instances) {
+            glm::vec3 offset;
 
-            if (p.emit != glm::vec3(0.0f)) {
-                ++stat.light_sources_count;
+            if (other.prim_num == inst.prim_num && other.to_world == glm::mat4(1.0f) &&
+                same_geometry(sc, other.prim_base, prim_base, inst.prim_num, offset)) {
+                inst.mesh = other.mesh;
+                inst.to_world = glm::translate(glm::mat4(1.0f), offset);
+                inst.to_object = glm::translate(glm::mat4(1.0f), -offset);
+                break;
             }
+        }
+
+        if (inst.mesh == meshes_count) {
+            ++meshes_count;
+        }
+
+        instances.push_back(inst);
+    }
+
+    stat.instances_count = instances.size();
+    stat.meshes_count = meshes_count;
+
+    /* Vertices left only on dropped faces are removed, the rest remember their first patch */
+    const std::uint32_t UNUSED = 0xFFFFFFFFu;
+    std::vector<std::uint32_t> remap(sc.vertices.size(), UNUSED);
+    std::vector<glm::vec3> used_vertices;
+
+    for (std::uint32_t i = 0; i < sc.indices.size(); i++) {
+        std::uint32_t &index = sc.indices[i];
+
+        if (remap[index] == UNUSED) {
+            remap[index] = (std::uint32_t) used_vertices.size();
+            used_vertices.push_back(sc.vertices[index]);
+            sc.vertex_patch.push_back(i / MAX_CORNERS);
+        }
+
+        index = remap[index];
+    }
+
+    sc.vertices = std::move(used_vertices);
+
+    if (stat.fanned_count > 0) {
+        std::cerr << "WARN: " << stat.fanned_count << " faces could not be ear clipped, "
+                  << "they were split as fans and may cover area outside their outline" << std::endl;
+    }
+
+    /* Solver state and output */
+    sc.size = (std::uint32_t) sc.normal.size();
+
+    find_emitters(sc);
+    stat.light_sources_count = sc.emitters.size();
+
+    for (int wave_len = 0; wave_len < 3; wave_len++) {
+        sc.p_total[wave_len].assign(sc.size, 0.0f);
+        sc.p_unshot[wave_len].assign(sc.size, 0.0f);
+        sc.p_recieved[wave_len].assign(sc.size, 0.0f);
+    }
+
+    sc.colors.assign(sc.vertices.size(), glm::vec3(0.0f));
+
+    return sc;
+}
+
+void find_emitters(scene &sc) {
+    sc.emitters.clear();
+
+    for (std::uint32_t p = 0; p < sc.size; p++) {
+        if (emittance(sc, 0, p) != 0.0f || emittance(sc, 1, p) != 0.0f || emittance(sc, 2, p) != 0.0f) {
+            sc.emitters.push_back(p);
+        }
+    }
+}
+
+void set_material(scene &sc, std::uint16_t id, const glm::vec3 &color, const glm::vec3 &emit) {
+    for (int wave_len = 0; wave_len < 3; wave_len++) {
+        sc.color[wave_len][id] = color[wave_len];
+        sc.emit[wave_len][id] = emit[wave_len];
+    }
 
-            patches.push_back(p);
+    find_emitters(sc);
+}
+
+std::vector<std::uint16_t> light_materials(const scene &sc) {
+    std::vector<std::uint16_t> lights;
 
-            index_offset += fv;
+    for (std::size_t m = 0; m < sc.material_name.size(); m++) {
+        if (sc.emit[0][m] > 0.0f || sc.emit[1][m] > 0.0f || sc.emit[2][m] > 0.0f) {
+            lights.push_back((std::uint16_t) m);
         }
     }
 
-    return patches;
+    return lights;
+}
+
+std::size_t parallel_threads(std::size_t count, std::size_t min_chunk) {
+    std::size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    return std::max((std::size_t) 1, std::min(threads, count / min_chunk));
+}
+
+void parallel_ranges(std::size_t count, std::size_t min_chunk,
+                     const std::function<void(std::size_t, std::size_t, std::size_t)> &fn) {
+    std::size_t threads = parallel_threads(count, min_chunk);
+
+    std::vector<std::thread> workers;
+    for (std::size_t i = 1; i < threads; i++) {
+        workers.emplace_back(fn, count * i / threads, count * (i + 1) / threads, i);
+    }
+
+    fn(0, count / threads, 0);
+
+    for (auto &worker : workers) {
+        worker.join();
+    }
 }
 
-std::vector<float>  glify(const std::vector<patch *> &primitives, bool fill) {
-    std::vector<float> vertices;
+void parallel_items(std::size_t count, const std::function<void(std::size_t, std::size_t)> &fn) {
+    std::size_t threads = std::min<std::size_t>(std::max(1u, std::thread::hardware_concurrency()), count);
+    std::atomic<std::size_t> next(0);
+
+    auto take_items = [&](std::size_t thread) {
+        for (std::size_t item = next++; item < count; item = next++) {
+            fn(item, thread);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (std::size_t i = 1; i < threads; i++) {
+        workers.emplace_back(take_items, i);
+    }
 
-    for (const auto p : primitives) {
-        vertices.push_back(p->vertices[0].x);
-        vertices.push_back(p->vertices[0].y);
-        vertices.push_back(p->vertices[0].z);
+    take_items(0);
 
-        vertices.push_back(fill ? 0.6f : p->colors[0].r);
-        vertices.push_back(fill ? 0.6f : p->colors[0].g);
-        vertices.push_back(fill ? 0.6f : p->colors[0].b);
+    for (auto &worker : workers) {
+        worker.join();
+    }
+}
 
-        vertices.push_back(p->vertices[1].x);
-        vertices.push_back(p->vertices[1].y);
-        vertices.push_back(p->vertices[1].z);
+void glify(const scene &sc, float *colors) {
+    parallel_ranges(sc.vertices.size(), PARALLEL_MIN_CHUNK, [&sc, colors](std::size_t from, std::size_t to, std::size_t) {
+        for (std::size_t v = from; v < to; v++) {
+            colors[v * 3 + 0] = sc.colors[v].r;
+            colors[v * 3 + 1] = sc.colors[v].g;
+            colors[v * 3 + 2] = sc.colors[v].b;
+        }
+    });
+}
 
-        vertices.push_back(fill ? 0.6f : p->colors[1].r);
-        vertices.push_back(fill ? 0.6f : p->colors[1].g);
-        vertices.push_back(fill ? 0.6f : p->colors[1].b);
+/* Triangle list for drawing, quads are split along the 0-2 diagonal */
+std::vector<std::uint32_t> triangles(const scene &sc) {
+    std::vector<std::uint32_t> res;
+    res.reserve(2 * 3 * sc.size);
 
-        vertices.push_back(p->vertices[2].x);
-        vertices.push_back(p->vertices[2].y);
-        vertices.push_back(p->vertices[2].z);
+    for (std::uint32_t p = 0; p < sc.size; p++) {
+        const std::uint32_t *c = &sc.indices[MAX_CORNERS * p];
 
-        vertices.push_back(fill ? 0.6f : p->colors[2].r);
-        vertices.push_back(fill ? 0.6f : p->colors[2].g);
-        vertices.push_back(fill ? 0.6f : p->colors[2].b);
+        res.insert(res.end(), {c[0], c[1], c[2]});
+        if (is_quad(sc, p)) {
+            res.insert(res.end(), {c[0], c[2], c[3]});
+        }
     }
 
-    return vertices;
+    return res;
 }
 
-void update_buffers(GLuint *VAO, GLuint *VBO, std::vector<float> &vertices) {
+void update_buffers(GLuint *VAO, GLuint *VBO, GLuint *CBO, GLuint *EBO, const std::vector<glm::vec3> &positions,
+                    const std::vector<float> &colors, const std::vector<std::uint32_t> &indices) {
+    static_assert(sizeof(glm::vec3) == 3 * sizeof(GLfloat), "positions are uploaded as they are");
+
     glBindVertexArray(*VAO);
-    glBindBuffer(GL_ARRAY_BUFFER, *VBO);
 
-    glBufferSubData(GL_ARRAY_BUFFER, 0, vertices.size() * sizeof(GLfloat), vertices.data());
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid *) 0);
+    /* Adaptive meshing may have changed the sizes */
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, *EBO);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
+
+    glBindBuffer(GL_ARRAY_BUFFER, *VBO);
+    glBufferData(GL_ARRAY_BUFFER, positions.size() * sizeof(glm::vec3), positions.data(), GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), (GLvoid *) 0);
     glEnableVertexAttribArray(0); // position
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid *) (3 * sizeof(GLfloat)));
+
+    glBindBuffer(GL_ARRAY_BUFFER, *CBO);
+    glBufferData(GL_ARRAY_BUFFER, colors.size() * sizeof(GLfloat), colors.data(), GL_DYNAMIC_DRAW);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), (GLvoid *) 0);
     glEnableVertexAttribArray(1); // color
 
     glBindBuffer(GL_ARRAY_BUFFER, 0);
     glBindVertexArray(0);
 }
 
-void init_buffers(GLuint *VAO, GLuint *VBO, std::vector<float> &vertices) {
+void init_buffers(GLuint *VAO, GLuint *VBO, GLuint *CBO, GLuint *EBO, const std::vector<glm::vec3> &positions,
+                  const std::vector<float> &colors, const std::vector<std::uint32_t> &indices) {
     glGenVertexArrays(1, VAO);
     glGenBuffers(1, VBO);
+    glGenBuffers(1, CBO);
+    glGenBuffers(1, EBO);
 
-    glBindVertexArray(*VAO);
-    glBindBuffer(GL_ARRAY_BUFFER, *VBO);
-
-    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(GLfloat), vertices.data(), GL_DYNAMIC_DRAW);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid *) 0);
-    glEnableVertexAttribArray(0); // position
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid *) (3 * sizeof(GLfloat)));
-    glEnableVertexAttribArray(1); // color
+    update_buffers(VAO, VBO, CBO, EBO, positions, colors, indices);
+}
 
+/* Same vertices, new solution: only the color buffer is rewritten, in place */
+void update_colors(GLuint *CBO, const std::vector<float> &colors) {
+    glBindBuffer(GL_ARRAY_BUFFER, *CBO);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, colors.size() * sizeof(GLfloat), colors.data());
     glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glBindVertexArray(0);
 }
 
 settings process_flags(int argc, char **argv) {
@@ -194,6 +577,28 @@ settings process_flags(int argc, char **argv) {
                 s.verbose = true;
             } else if (arg == "-d") {
                 s.debug = true;
+            } else if (arg == "-bench") {
+                s.bench = true;
+            } else if (arg == "-a") {
+                s.adaptive = true;
+            } else if (arg == "-hr") {
+                s.hierarchical = true;
+            } else if (arg == "-compact") {
+                s.compact = true;
+            } else if (arg == "-bake") {
+                s.bake = true;
+            } else if (arg == "-histogram") {
+                s.histogram = true;
+            } else if (arg == "-qmc") {
+                s.qmc = true;
+            } else if (arg == "-bench-sampling") {
+                s.bench_sampling = true;
+            } else if (arg == "-channels") {
+                s.channels = true;
+            } else if (arg == "-white") {
+                s.white = true;
+            } else if (arg == "-gather") {
+                s.gather = true;
             }
         }
     }
@@ -209,6 +614,17 @@ settings process_flags(int argc, char **argv) {
         if (s.save_result) { std::cout << "SAVE RESULT(-s) " << std::flush; }
         if (s.show_stats) { std::cout << "SHOW STATS(-stats) " << std::flush; }
         if (s.debug) { std::cout << "DEBUG MODE(-d) " << std::flush; }
+        if (s.bench) { std::cout << "BENCHMARK(-bench) " << std::flush; }
+        if (s.adaptive) { std::cout << "ADAPTIVE(-a) " << std::flush; }
+        if (s.hierarchical) { std::cout << "HIERARCHICAL(-hr) " << std::flush; }
+        if (s.compact) { std::cout << "COMPACT RESULT(-compact) " << std::flush; }
+        if (s.bake) { std::cout << "BAKE LIGHTMAP(-bake) " << std::flush; }
+        if (s.histogram) { std::cout << "HISTOGRAM TONE MAPPING(-histogram) " << std::flush; }
+        if (s.qmc) { std::cout << "SOBOL SAMPLING(-qmc) " << std::flush; }
+        if (s.bench_sampling) { std::cout << "SAMPLING BENCHMARK(-bench-sampling) " << std::flush; }
+        if (s.channels) { std::cout << "PER CHANNEL TONE MAPPING(-channels) " << std::flush; }
+        if (s.white) { std::cout << "WHITE POINT(-white) " << std::flush; }
+        if (s.gather) { std::cout << "FINAL GATHER(-gather) " << std::flush; }
         std::cout << std::endl;
     }
 
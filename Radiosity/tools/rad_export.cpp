@@ -0,0 +1,44 @@
+#include "../includes/export.h"
+
+#include <iostream>
+
+bool ends_with(const std::string &s, const std::string &suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+/* Converts a result saved with -s for other tools.
+ * Usage: rad-export input output.ply|output.glb [-linear] */
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        std::cerr << "Usage: rad-export " << RESULT_PATH << " output.ply|output.glb [-linear]" << std::endl;
+        return 1;
+    }
+
+    std::string input = argv[1];
+    std::string output = argv[2];
+    bool linear = argc > 3 && std::string(argv[3]) == "-linear";
+
+    result_file result = {};
+    if (!map_result(input, result)) {
+        return 1;
+    }
+
+    bool written = false;
+
+    if (ends_with(output, ".ply")) {
+        written = export_ply(output, result, linear);
+    } else if (ends_with(output, ".glb")) {
+        written = export_glb(output, result, linear);
+    } else {
+        std::cerr << "Unknown output format: " << output << std::endl;
+    }
+
+    if (written) {
+        std::cout << output << ": " << result.header->vertex_count << " vertices, "
+                  << result.header->triangle_count << " triangles" << std::endl;
+    }
+
+    unmap_result(result);
+
+    return written ? 0 : 1;
+}
@@ -0,0 +1,36 @@
+#include "../includes/utils.h"
+#include "../includes/pack.h"
+
+#include <iostream>
+
+/* Converts an OBJ scene to the binary format the renderer maps directly.
+ * Usage: rad-pack input.obj output.radpack [-nobvh] */
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        std::cerr << "Usage: rad-pack input.obj output" << PACK_EXTENSION << " [-nobvh]" << std::endl;
+        return 1;
+    }
+
+    std::string input = argv[1];
+    std::string output = argv[2];
+    bool with_bvh = !(argc > 3 && std::string(argv[3]) == "-nobvh");
+
+    stats stat = {};
+    std::vector<instance> instances;
+
+    scene sc = load_mesh(input, instances, stat);
+    scene_bvh world = {};
+
+    if (with_bvh) {
+        world = bvh(sc, instances);
+    }
+
+    if (!save_pack(output, sc, instances, with_bvh ? &world : nullptr, stat)) {
+        return 1;
+    }
+
+    std::cout << output << ": " << sc.size << " patches, " << sc.vertices.size() << " vertices, "
+              << stat.instances_count << " instances" << (with_bvh ? ", BVH" : "") << std::endl;
+
+    return 0;
+}